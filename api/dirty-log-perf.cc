@@ -1,6 +1,7 @@
 #include "kvmxx.hh"
 #include "memmap.hh"
 #include "identity.hh"
+#include "pattern.hh"
 #include <boost/thread/thread.hpp>
 #include <stdlib.h>
 #include <stdio.h>
@@ -11,6 +12,13 @@ namespace {
 const int page_size	= 4096;
 int64_t nr_total_pages	= 256 * 1024;
 int64_t nr_slot_pages	= 256 * 1024;
+std::string pattern_name = "strided";
+uint64_t pattern_seed	= 1;
+double zipf_skew	= 1.0;
+int nr_slots		= 1;
+int nr_threads		= 1;
+
+typedef std::tr1::shared_ptr<mem_slot> mem_slot_ptr;
 
 // Return the current time in nanoseconds.
 uint64_t time_ns()
@@ -21,48 +29,65 @@ uint64_t time_ns()
     return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
 }
 
-// Update nr_to_write pages selected from nr_pages pages.
-void write_mem(void* slot_head, int64_t nr_to_write, int64_t nr_pages)
+// Update nr_to_write pages chosen by the access pattern generator.
+void write_mem(void* slot_head, pattern::generator& gen, int64_t nr_to_write)
 {
-    char* var = static_cast<char*>(slot_head);
-    int64_t interval = nr_pages / nr_to_write;
+    char* head = static_cast<char*>(slot_head);
 
     for (int64_t i = 0; i < nr_to_write; ++i) {
-        ++(*var);
-        var += interval * page_size;
+        ++head[gen.next() * page_size];
     }
 }
 
 using boost::ref;
 using std::tr1::bind;
 
-// Let the guest update nr_to_write pages selected from nr_pages pages.
+// Let the guest update nr_to_write pages chosen by gen.
 void do_guest_write(kvm::vcpu& vcpu, void* slot_head,
-                    int64_t nr_to_write, int64_t nr_pages)
+                    pattern::generator& gen, int64_t nr_to_write)
 {
+    gen.start(nr_to_write);
     identity::vcpu guest_write_thread(vcpu, bind(write_mem, ref(slot_head),
-                                                 nr_to_write, nr_pages));
+                                                 ref(gen), nr_to_write));
     vcpu.run();
 }
 
 // Check how long it takes to update dirty log.
-void check_dirty_log(kvm::vcpu& vcpu, mem_slot& slot, void* slot_head)
+void check_dirty_log(kvm::vcpu& vcpu, mem_map& memmap,
+                     std::vector<mem_slot_ptr>& slots, void* slot_head,
+                     pattern::generator& gen)
 {
-    slot.set_dirty_logging(true);
-    slot.update_dirty_log();
+    std::vector<uint64_t> dirty;
+    std::vector<dirty_log_stats> stats;
+
+    for (unsigned i = 0; i < slots.size(); ++i) {
+        slots[i]->set_dirty_logging(true);
+    }
+    memmap.update_dirty_logs(dirty, stats, nr_threads);
 
     for (int64_t i = 1; i <= nr_slot_pages; i *= 2) {
-        do_guest_write(vcpu, slot_head, i, nr_slot_pages);
+        do_guest_write(vcpu, slot_head, gen, i);
 
+        dirty.clear();
         uint64_t start_ns = time_ns();
-        slot.update_dirty_log();
+        memmap.update_dirty_logs(dirty, stats, nr_threads);
         uint64_t end_ns = time_ns();
 
-        printf("get dirty log: %10lld ns for %10lld dirty pages\n",
-               end_ns - start_ns, i);
+        printf("get dirty log: %10lld ns for %10lld writes, "
+               "%10lld dirty pages\n",
+               end_ns - start_ns, i, (int64_t)dirty.size());
+        if (stats.size() > 1) {
+            for (unsigned j = 0; j < stats.size(); ++j) {
+                printf("    slot %3d: %10lld ns, %10lld dirty pages\n",
+                       stats[j].slot, (int64_t)stats[j].harvest_ns,
+                       (int64_t)stats[j].nr_dirty);
+            }
+        }
     }
 
-    slot.set_dirty_logging(false);
+    for (unsigned i = 0; i < slots.size(); ++i) {
+        slots[i]->set_dirty_logging(false);
+    }
 }
 
 }
@@ -72,7 +97,7 @@ void parse_options(int ac, char **av)
     int opt;
     char *endptr;
 
-    while ((opt = getopt(ac, av, "n:m:")) != -1) {
+    while ((opt = getopt(ac, av, "n:m:p:s:z:S:j:")) != -1) {
         switch (opt) {
         case 'n':
             errno = 0;
@@ -96,6 +121,42 @@ void parse_options(int ac, char **av)
                 nr_total_pages *= 1024;
             }
             break;
+        case 'p':
+            pattern_name = optarg;
+            break;
+        case 's':
+            errno = 0;
+            pattern_seed = strtoull(optarg, &endptr, 0);
+            if (errno || endptr == optarg) {
+                printf("dirty-log-perf: Invalid number: -s %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'z':
+            errno = 0;
+            zipf_skew = strtod(optarg, &endptr);
+            if (errno || endptr == optarg || zipf_skew < 0) {
+                printf("dirty-log-perf: Invalid skew: -z %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'S':
+            errno = 0;
+            nr_slots = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || *endptr || nr_slots < 1) {
+                printf("dirty-log-perf: Invalid slot count: -S %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'j':
+            errno = 0;
+            nr_threads = strtol(optarg, &endptr, 10);
+            if (errno || endptr == optarg || *endptr || nr_threads < 1) {
+                printf("dirty-log-perf: Invalid thread count: -j %s\n",
+                       optarg);
+                exit(1);
+            }
+            break;
         default:
             printf("dirty-log-perf: Invalid option\n");
             exit(1);
@@ -107,8 +168,17 @@ void parse_options(int ac, char **av)
                nr_slot_pages, nr_total_pages);
         exit(1);
     }
+    if (nr_slots < 1 || nr_slots > nr_slot_pages || nr_threads < 1) {
+        printf("dirty-log-perf: Invalid setting: %d slots, %d threads\n",
+               nr_slots, nr_threads);
+        exit(1);
+    }
     printf("dirty-log-perf: %lld slot pages / %lld mem pages\n",
            nr_slot_pages, nr_total_pages);
+    printf("dirty-log-perf: %d logged slots, %d harvest threads\n",
+           nr_slots, nr_threads);
+    printf("dirty-log-perf: pattern %s, seed %llu, zipf skew %g\n",
+           pattern_name.c_str(), (unsigned long long)pattern_seed, zipf_skew);
 }
 
 int main(int ac, char **av)
@@ -131,14 +201,35 @@ int main(int ac, char **av)
     identity::vm ident_vm(vm, memmap, hole);
     kvm::vcpu vcpu(vm, 0);
 
-    uint64_t slot_size = nr_slot_pages * page_size;
-    uint64_t next_size = mem_size - slot_size;
-    uint64_t next_addr = mem_addr + slot_size;
-    mem_slot slot(memmap, mem_addr, slot_size, mem_head);
+    // Split the logged range into nr_slots slots; the last one takes
+    // whatever is left over.
+    std::vector<mem_slot_ptr> slots;
+    uint64_t slot_addr = mem_addr;
+    for (int i = 0; i < nr_slots; ++i) {
+        int64_t pages = nr_slot_pages / nr_slots;
+        if (i == nr_slots - 1) {
+            pages += nr_slot_pages % nr_slots;
+        }
+        uint64_t size = pages * page_size;
+        slots.push_back(mem_slot_ptr(new mem_slot(memmap, slot_addr, size,
+                                                  (void *)slot_addr)));
+        slot_addr += size;
+    }
+    uint64_t next_size = mem_size - nr_slot_pages * page_size;
+    uint64_t next_addr = slot_addr;
     mem_slot other_slot(memmap, next_addr, next_size, (void *)next_addr);
 
+    pattern::generator_ptr gen = pattern::create(pattern_name, nr_slot_pages,
+                                                 pattern_seed, zipf_skew);
+    if (!gen) {
+        printf("dirty-log-perf: Unknown pattern %s (one of: %s)\n",
+               pattern_name.c_str(), pattern::names);
+        exit(1);
+    }
+
     // pre-allocate shadow pages
-    do_guest_write(vcpu, mem_head, nr_total_pages, nr_total_pages);
-    check_dirty_log(vcpu, slot, mem_head);
+    pattern::sequential prefault(nr_total_pages);
+    do_guest_write(vcpu, mem_head, prefault, nr_total_pages);
+    check_dirty_log(vcpu, memmap, slots, mem_head, *gen);
     return 0;
 }
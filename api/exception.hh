@@ -7,6 +7,8 @@ class errno_exception : public std::exception {
 public:
     explicit errno_exception(int err_no);
     int errno() const;
+    // Same as errno(), but usable where <errno.h> defines errno as a macro.
+    int code() const { return _errno; }
     virtual const char *what();
 private:
     int _errno;
@@ -0,0 +1,220 @@
+#include "kvmxx.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include "exception.hh"
+#include <boost/thread/thread.hpp>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Measure how long it takes from signalling a vcpu thread until KVM_RUN
+// returns to userspace, which bounds how fast a VMM can pause a vcpu.
+//
+// Kick modes:
+//   mask	signal blocked in the thread, unblocked in guest mode with
+//		KVM_SET_SIGNAL_MASK, pending signal eaten with sigtimedwait
+//   exit	signal unblocked, the handler sets kvm_run.immediate_exit
+//   throw	like mask, but through the throwing vcpu::run()
+
+namespace {
+
+const int kick_signal	= SIGUSR1;
+int nr_kicks		= 10000;
+unsigned interval_us	= 100;
+std::string mode	= "mask";
+
+kvm::vcpu* kicked_vcpu;
+bool use_immediate_exit;
+volatile uint64_t kick_ns;
+volatile int nr_ready;
+volatile int nr_acked;
+
+// Return the current time in nanoseconds.
+uint64_t time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+void spin(volatile bool& running)
+{
+    while (running) {
+        asm volatile("pause");
+    }
+}
+
+void kick_handler(int sig)
+{
+    if (use_immediate_exit) {
+        kicked_vcpu->set_immediate_exit(true);
+    }
+}
+
+void kicker(kvm::vcpu& vcpu, volatile bool& running)
+{
+    struct timespec ts = { interval_us / 1000000,
+                           (interval_us % 1000000) * 1000 };
+
+    for (int i = 0; i < nr_kicks; ++i) {
+        while (nr_ready <= i) {
+            asm volatile("pause");
+        }
+        nanosleep(&ts, NULL);
+        kick_ns = time_ns();
+        vcpu.kick(kick_signal);
+        while (nr_acked <= i) {
+            asm volatile("pause");
+        }
+    }
+    running = false;
+}
+
+// Enter the guest until it is kicked out; returns the KVM_RUN result.
+int run_once(kvm::vcpu& vcpu)
+{
+    if (mode != "throw") {
+        return vcpu.try_run();
+    }
+    try {
+        vcpu.run();
+    } catch (errno_exception& e) {
+        return -e.code();
+    }
+    return 0;
+}
+
+void eat_signal(const sigset_t& set)
+{
+    struct timespec zero = { 0, 0 };
+
+    while (sigtimedwait(&set, NULL, &zero) > 0) {
+    }
+}
+
+void setup_signals(kvm::vcpu& vcpu, sigset_t& set)
+{
+    sigemptyset(&set);
+    sigaddset(&set, kick_signal);
+
+    // Ignored signals are discarded at generation time, so even the
+    // blocked modes need a handler.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = kick_handler;
+    kicked_vcpu = &vcpu;
+    use_immediate_exit = mode == "exit";
+    sigaction(kick_signal, &sa, NULL);
+
+    if (mode == "exit") {
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        return;
+    }
+    sigset_t guest_mask;
+    pthread_sigmask(SIG_BLOCK, &set, &guest_mask);
+    sigdelset(&guest_mask, kick_signal);
+    vcpu.set_signal_mask(&guest_mask);
+}
+
+void report(std::vector<uint64_t>& lat)
+{
+    std::sort(lat.begin(), lat.end());
+    uint64_t sum = 0;
+    for (unsigned i = 0; i < lat.size(); ++i) {
+        sum += lat[i];
+    }
+    printf("kick-latency (%s): %d kicks\n", mode.c_str(), (int)lat.size());
+    printf("  min    %10llu ns\n", (unsigned long long)lat.front());
+    printf("  avg    %10llu ns\n", (unsigned long long)(sum / lat.size()));
+    printf("  median %10llu ns\n", (unsigned long long)lat[lat.size() / 2]);
+    printf("  99%%    %10llu ns\n",
+           (unsigned long long)lat[lat.size() * 99 / 100]);
+    printf("  max    %10llu ns\n", (unsigned long long)lat.back());
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+
+    while ((opt = getopt(ac, av, "n:i:m:")) != -1) {
+        switch (opt) {
+        case 'n':
+            nr_kicks = atoi(optarg);
+            break;
+        case 'i':
+            interval_us = atoi(optarg);
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        default:
+            printf("usage: kick-latency [-n kicks] [-i interval_us] "
+                   "[-m mask|exit|throw]\n");
+            exit(1);
+        }
+    }
+    if (nr_kicks < 1 || (mode != "mask" && mode != "exit"
+                         && mode != "throw")) {
+        printf("kick-latency: Invalid setting: %d kicks, mode %s\n",
+               nr_kicks, mode.c_str());
+        exit(1);
+    }
+}
+
+}
+
+using boost::ref;
+using std::tr1::bind;
+
+int test_main(int ac, char **av)
+{
+    parse_options(ac, av);
+
+    kvm::system sys;
+    if (mode == "exit" && !sys.check_extension(KVM_CAP_IMMEDIATE_EXIT)) {
+        printf("kick-latency: KVM_CAP_IMMEDIATE_EXIT not supported\n");
+        return 1;
+    }
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    identity::vm ident_vm(vm, memmap);
+    kvm::vcpu vcpu(vm, 0);
+
+    sigset_t set;
+    setup_signals(vcpu, set);
+
+    bool running = true;
+    std::vector<uint64_t> lat;
+    identity::vcpu guest_thread(vcpu, bind(spin, ref(running)));
+    boost::thread kicker_thread(kicker, ref(vcpu), ref(running));
+
+    for (int i = 0; i < nr_kicks; ++i) {
+        nr_ready = i + 1;
+        int r = run_once(vcpu);
+        uint64_t exit_ns = time_ns();
+        if (r != -EINTR) {
+            printf("kick-latency: unexpected KVM_RUN result %d\n", r);
+            exit(1);
+        }
+        lat.push_back(exit_ns - kick_ns);
+        if (mode == "exit") {
+            vcpu.set_immediate_exit(false);
+        } else {
+            eat_signal(set);
+        }
+        nr_acked = i + 1;
+    }
+    kicker_thread.join();
+    run_once(vcpu);
+
+    report(lat);
+    return 0;
+}
+
+int main(int ac, char **av)
+{
+    return try_main(test_main, ac, av);
+}
@@ -4,6 +4,7 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <cstring>
 #include <memory>
 #include <algorithm>
 
@@ -39,9 +40,16 @@ long fd::ioctl(unsigned nr, long arg)
     return check_error(::ioctl(_fd, nr, arg));
 }
 
+long fd::try_ioctl(unsigned nr, long arg)
+{
+    long r = ::ioctl(_fd, nr, arg);
+    return r == -1 ? -errno : r;
+}
+
 vcpu::vcpu(vm& vm, int id)
     : _vm(vm), _fd(vm._fd.ioctl(KVM_CREATE_VCPU, id)), _shared(NULL)
     , _mmap_size(_vm._system._fd.ioctl(KVM_GET_VCPU_MMAP_SIZE, 0))
+    , _thread(pthread_self())
 
 {
     kvm_run *shared = static_cast<kvm_run*>(::mmap(NULL, _mmap_size,
@@ -61,9 +69,53 @@ vcpu::~vcpu()
 
 void vcpu::run()
 {
+    _thread = pthread_self();
     _fd.ioctl(KVM_RUN, 0);
 }
 
+int vcpu::try_run()
+{
+    _thread = pthread_self();
+    return _fd.try_ioctl(KVM_RUN, 0);
+}
+
+// Signal the thread that last entered run()/try_run().
+void vcpu::kick(int sig)
+{
+    int r = pthread_kill(_thread, sig);
+    if (r) {
+	throw errno_exception(r);
+    }
+}
+
+// Signals blocked while the vcpu is in guest mode; pass NULL to use the
+// calling thread's mask.
+void vcpu::set_signal_mask(const sigset_t* mask)
+{
+    const unsigned kernel_sigset_size = 8;
+    std::vector<char> buf(sizeof(kvm_signal_mask) + kernel_sigset_size);
+    kvm_signal_mask* ksm = reinterpret_cast<kvm_signal_mask*>(&buf[0]);
+
+    if (mask) {
+	ksm->len = kernel_sigset_size;
+	std::memcpy(ksm->sigset, mask, kernel_sigset_size);
+	_fd.ioctlp(KVM_SET_SIGNAL_MASK, ksm);
+    } else {
+	_fd.ioctl(KVM_SET_SIGNAL_MASK, 0);
+    }
+}
+
+// Make the next KVM_RUN return -EINTR without entering the guest.
+void vcpu::set_immediate_exit(bool enabled)
+{
+    _shared->immediate_exit = enabled;
+}
+
+kvm_run *vcpu::shared()
+{
+    return _shared;
+}
+
 kvm_regs vcpu::regs()
 {
     kvm_regs regs;
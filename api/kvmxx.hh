@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <linux/kvm.h>
 #include <stdint.h>
+#include <pthread.h>
 
 namespace kvm {
 
@@ -27,6 +28,8 @@ public:
     long ioctlp(unsigned nr, void *arg) {
 	return ioctl(nr, reinterpret_cast<long>(arg));
     }
+    // Like ioctl(), but returns -errno instead of throwing.
+    long try_ioctl(unsigned nr, long arg);
 private:
     int _fd;
 };
@@ -36,6 +39,11 @@ public:
     vcpu(vm& vm, int fd);
     ~vcpu();
     void run();
+    // Returns 0 or -errno (typically -EINTR after a kick); never throws.
+    int try_run();
+    void kick(int sig);
+    void set_signal_mask(const sigset_t* mask);
+    void set_immediate_exit(bool enabled);
     kvm_run *shared();
     kvm_regs regs();
     void set_regs(const kvm_regs& regs);
@@ -51,6 +59,7 @@ private:
     fd _fd;
     kvm_run *_shared;
     unsigned _mmap_size;
+    pthread_t _thread;
     friend class vm;
 };
 
@@ -1,5 +1,19 @@
 
 #include "memmap.hh"
+#include <tr1/functional>
+#include <time.h>
+
+namespace {
+
+uint64_t time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+}
 
 mem_slot::mem_slot(mem_map& map, uint64_t gpa, uint64_t size, void* hva)
     : _map(map)
@@ -12,10 +26,12 @@ mem_slot::mem_slot(mem_map& map, uint64_t gpa, uint64_t size, void* hva)
 {
     map._free_slots.pop();
     update();
+    map._slots[_slot] = this;
 }
 
 mem_slot::~mem_slot()
 {
+    _map._slots.erase(_slot);
     _size = 0;
     try {
         update();
@@ -66,11 +82,162 @@ bool mem_slot::is_dirty(uint64_t gpa) const
     return _log[wordnr] & bit;
 }
 
+uint64_t mem_slot::nr_dirty() const
+{
+    uint64_t count = 0;
+    for (std::vector<ulong>::const_iterator i = _log.begin();
+         i != _log.end(); ++i) {
+        count += __builtin_popcountl(*i);
+    }
+    return count;
+}
+
+// Append the address of every page marked in the last harvested log.
+void mem_slot::dirty_pages(std::vector<uint64_t>& gpas) const
+{
+    for (ulong wordnr = 0; wordnr < _log.size(); ++wordnr) {
+        ulong word = _log[wordnr];
+        while (word) {
+            uint64_t pagenr = wordnr * bits_per_word + __builtin_ctzl(word);
+            word &= word - 1;
+            gpas.push_back(_gpa + (pagenr << 12));
+        }
+    }
+}
+
 mem_map::mem_map(kvm::vm& vm)
     : _vm(vm)
+    , _pool_size(0)
+    , _job(0)
+    , _generation(0)
+    , _nr_helpers(0)
+    , _pending(0)
+    , _stopping(false)
 {
     int nr_slots = vm.sys().get_extension_int(KVM_CAP_NR_MEMSLOTS);
     for (int i = 0; i < nr_slots; ++i) {
         _free_slots.push(i);
     }
 }
+
+mem_map::~mem_map()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(_pool_lock);
+        _stopping = true;
+    }
+    _work_cond.notify_all();
+    _pool.join_all();
+}
+
+struct mem_map::harvest_job {
+    std::vector<mem_slot*> slots;
+    std::vector<std::vector<uint64_t> > dirty;
+    std::vector<dirty_log_stats> stats;
+    unsigned long next;
+};
+
+void mem_map::harvest_worker(harvest_job& job)
+{
+    unsigned long i;
+
+    while ((i = __sync_fetch_and_add(&job.next, 1)) < job.slots.size()) {
+        mem_slot* slot = job.slots[i];
+        uint64_t start_ns = time_ns();
+        slot->update_dirty_log();
+        uint64_t end_ns = time_ns();
+        slot->dirty_pages(job.dirty[i]);
+
+        dirty_log_stats& st = job.stats[i];
+        st.slot = slot->slot_id();
+        st.gpa = slot->gpa();
+        st.nr_dirty = job.dirty[i].size();
+        st.harvest_ns = end_ns - start_ns;
+    }
+}
+
+// Pool thread number index; generation is the last job it must not run.
+void mem_map::pool_worker(unsigned index, unsigned generation)
+{
+    for (;;) {
+        harvest_job* job;
+        {
+            boost::unique_lock<boost::mutex> lock(_pool_lock);
+            while (_generation == generation && !_stopping) {
+                _work_cond.wait(lock);
+            }
+            if (_stopping) {
+                return;
+            }
+            generation = _generation;
+            if (index >= _nr_helpers) {
+                continue;
+            }
+            job = _job;
+        }
+        harvest_worker(*job);
+        {
+            boost::lock_guard<boost::mutex> lock(_pool_lock);
+            if (--_pending == 0) {
+                _done_cond.notify_one();
+            }
+        }
+    }
+}
+
+// Run job on the calling thread and nr_helpers pool threads.
+void mem_map::run_pool(harvest_job& job, unsigned nr_helpers)
+{
+    boost::unique_lock<boost::mutex> lock(_pool_lock);
+
+    while (_pool_size < nr_helpers) {
+        _pool.create_thread(std::tr1::bind(&mem_map::pool_worker, this,
+                                           _pool_size, _generation));
+        ++_pool_size;
+    }
+    _job = &job;
+    _nr_helpers = nr_helpers;
+    _pending = nr_helpers;
+    ++_generation;
+    lock.unlock();
+    _work_cond.notify_all();
+
+    harvest_worker(job);
+
+    lock.lock();
+    while (_pending) {
+        _done_cond.wait(lock);
+    }
+    _job = 0;
+}
+
+void mem_map::update_dirty_logs(std::vector<uint64_t>& dirty,
+                                std::vector<dirty_log_stats>& stats,
+                                unsigned nr_threads)
+{
+    harvest_job job;
+
+    for (std::map<int, mem_slot*>::iterator i = _slots.begin();
+         i != _slots.end(); ++i) {
+        if (i->second->dirty_logging()) {
+            job.slots.push_back(i->second);
+        }
+    }
+    job.dirty.resize(job.slots.size());
+    job.stats.resize(job.slots.size());
+    job.next = 0;
+
+    if (nr_threads > job.slots.size()) {
+        nr_threads = job.slots.size();
+    }
+    if (nr_threads <= 1) {
+        harvest_worker(job);
+    } else {
+        run_pool(job, nr_threads - 1);
+    }
+
+    for (unsigned i = 0; i < job.slots.size(); ++i) {
+        dirty.insert(dirty.end(), job.dirty[i].begin(), job.dirty[i].end());
+    }
+    stats.swap(job.stats);
+}
@@ -2,9 +2,13 @@
 #define MEMMAP_HH
 
 #include "kvmxx.hh"
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <stdint.h>
 #include <vector>
 #include <stack>
+#include <map>
 
 class mem_map;
 class mem_slot;
@@ -17,6 +21,12 @@ public:
     bool dirty_logging() const;
     void update_dirty_log();
     bool is_dirty(uint64_t gpa) const;
+    uint64_t nr_dirty() const;
+    void dirty_pages(std::vector<uint64_t>& gpas) const;
+    int slot_id() const { return _slot; }
+    uint64_t gpa() const { return _gpa; }
+    uint64_t size() const { return _size; }
+    void *hva() const { return _hva; }
 private:
     void update();
 private:
@@ -31,12 +41,44 @@ private:
     std::vector<ulong> _log;
 };
 
+struct dirty_log_stats {
+    int slot;
+    uint64_t gpa;
+    uint64_t nr_dirty;
+    uint64_t harvest_ns;
+};
+
 class mem_map {
 public:
     mem_map(kvm::vm& vm);
+    ~mem_map();
+    // Harvest the dirty log of every slot that has logging enabled, spread
+    // over up to nr_threads threads.  Dirty page addresses of all slots
+    // are appended to dirty; per-slot timings replace the contents of stats.
+    // The caller's thread takes part; the other nr_threads - 1 come from a
+    // pool that is started on first use and kept until the map goes away.
+    void update_dirty_logs(std::vector<uint64_t>& dirty,
+                           std::vector<dirty_log_stats>& stats,
+                           unsigned nr_threads = 1);
+private:
+    struct harvest_job;
+    static void harvest_worker(harvest_job& job);
+    void pool_worker(unsigned index, unsigned generation);
+    void run_pool(harvest_job& job, unsigned nr_helpers);
 private:
     kvm::vm& _vm;
     std::stack<int> _free_slots;
+    std::map<int, mem_slot*> _slots;
+    boost::thread_group _pool;
+    unsigned _pool_size;
+    boost::mutex _pool_lock;
+    boost::condition_variable _work_cond;
+    boost::condition_variable _done_cond;
+    harvest_job* _job;
+    unsigned _generation;
+    unsigned _nr_helpers;
+    unsigned _pending;
+    bool _stopping;
     friend class mem_slot;
 };
 
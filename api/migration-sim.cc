@@ -0,0 +1,355 @@
+#include "kvmxx.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include "pattern.hh"
+#include "exception.hh"
+#include <boost/thread/thread.hpp>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Pre-copy live migration simulator: the guest keeps dirtying memory
+// while the host harvests the dirty log and copies dirty pages into a
+// destination buffer, round after round, until the remaining dirty set
+// fits the downtime budget.  The last round stops the guest and copies
+// what is left, which is the downtime a real migration would see.
+
+namespace {
+
+const int page_size	= 4096;
+int64_t nr_slot_pages	= 64 * 1024;
+uint64_t bandwidth	= 0;	// bytes per second, 0 means unlimited
+uint64_t max_downtime_ns = 300 * 1000000ULL;
+int max_rounds		= 30;
+unsigned guest_delay	= 1000;
+std::string pattern_name = "random";
+uint64_t pattern_seed	= 1;
+double zipf_skew	= 1.0;
+
+// Return the current time in nanoseconds.
+uint64_t time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+void delay_loop(unsigned n)
+{
+    for (unsigned i = 0; i < n; ++i) {
+        asm volatile("pause");
+    }
+}
+
+// Guest: dirty pages picked by gen until the host says stop.  gen is
+// restarted whenever the host begins a new pre-copy round, so "rewrite"
+// replays the same pages every round.
+void dirty_mem(volatile bool& running, volatile bool& stopped,
+               volatile int& round, void* slot_head,
+               pattern::generator& gen)
+{
+    char* head = static_cast<char*>(slot_head);
+    int seen = round;
+
+    while (running) {
+        if (round != seen) {
+            seen = round;
+            gen.start(nr_slot_pages);
+        }
+        ++head[gen.next() * page_size];
+        delay_loop(guest_delay);
+    }
+    stopped = true;
+}
+
+// Sleep until copying bytes since start_ns no longer exceeds the cap.
+void throttle(uint64_t start_ns, uint64_t bytes)
+{
+    if (!bandwidth) {
+        return;
+    }
+    uint64_t due_ns = start_ns + bytes * 1000000000ULL / bandwidth;
+    uint64_t now_ns = time_ns();
+    if (due_ns > now_ns) {
+        struct timespec ts;
+        ts.tv_sec = (due_ns - now_ns) / 1000000000ULL;
+        ts.tv_nsec = (due_ns - now_ns) % 1000000000ULL;
+        nanosleep(&ts, NULL);
+    }
+}
+
+struct round_stats {
+    uint64_t nr_dirty;
+    uint64_t harvest_ns;
+    uint64_t copy_ns;
+};
+
+class migration {
+public:
+    migration(mem_slot& slot, char* dest);
+    void run(volatile bool& running, volatile bool& stopped,
+             volatile int& round);
+    bool verify() const;
+private:
+    round_stats copy_all();
+    round_stats copy_dirty();
+    void print(const char* name, const round_stats& st) const;
+    bool converged(const round_stats& st) const;
+private:
+    mem_slot& _slot;
+    char* _dest;
+    std::vector<uint64_t> _dirty;
+    uint64_t _bytes_copied;
+    int _round;
+};
+
+migration::migration(mem_slot& slot, char* dest)
+    : _slot(slot), _dest(dest), _dirty(), _bytes_copied(0), _round(0)
+{
+}
+
+round_stats migration::copy_all()
+{
+    round_stats st = { };
+    const char* src = static_cast<const char*>(_slot.hva());
+
+    st.nr_dirty = _slot.size() / page_size;
+    uint64_t start_ns = time_ns();
+    for (uint64_t off = 0; off < _slot.size(); off += page_size) {
+        memcpy(_dest + off, src + off, page_size);
+        throttle(start_ns, off + page_size);
+    }
+    st.copy_ns = time_ns() - start_ns;
+    _bytes_copied += _slot.size();
+    return st;
+}
+
+round_stats migration::copy_dirty()
+{
+    round_stats st = { };
+    const char* src = static_cast<const char*>(_slot.hva());
+
+    uint64_t start_ns = time_ns();
+    _slot.update_dirty_log();
+    _dirty.clear();
+    _slot.dirty_pages(_dirty);
+    st.harvest_ns = time_ns() - start_ns;
+    st.nr_dirty = _dirty.size();
+
+    start_ns = time_ns();
+    uint64_t bytes = 0;
+    for (std::vector<uint64_t>::const_iterator i = _dirty.begin();
+         i != _dirty.end(); ++i) {
+        uint64_t off = *i - _slot.gpa();
+        memcpy(_dest + off, src + off, page_size);
+        bytes += page_size;
+        throttle(start_ns, bytes);
+    }
+    st.copy_ns = time_ns() - start_ns;
+    _bytes_copied += bytes;
+    return st;
+}
+
+// The remaining dirty set is small enough to stop the guest if copying
+// it again would fit the downtime budget.
+bool migration::converged(const round_stats& st) const
+{
+    uint64_t bytes = st.nr_dirty * page_size;
+    uint64_t estimate_ns;
+
+    if (bandwidth) {
+        estimate_ns = bytes * 1000000000ULL / bandwidth;
+    } else {
+        estimate_ns = st.copy_ns;
+    }
+    return st.harvest_ns + estimate_ns <= max_downtime_ns;
+}
+
+void migration::print(const char* name, const round_stats& st) const
+{
+    printf("%-9s %3d: %10llu dirty pages, harvest %12llu ns, "
+           "copy %12llu ns\n", name, _round,
+           (unsigned long long)st.nr_dirty,
+           (unsigned long long)st.harvest_ns,
+           (unsigned long long)st.copy_ns);
+}
+
+void migration::run(volatile bool& running, volatile bool& stopped,
+                    volatile int& round)
+{
+    _slot.set_dirty_logging(true);
+    _slot.update_dirty_log();
+
+    uint64_t start_ns = time_ns();
+    round_stats st = copy_all();
+    print("bulk", st);
+
+    bool done = false;
+    while (!done && ++_round <= max_rounds) {
+        round = _round;
+        st = copy_dirty();
+        print("iterate", st);
+        done = converged(st);
+    }
+
+    running = false;
+    while (!stopped) {
+        delay_loop(100);
+    }
+    st = copy_dirty();
+    print("stop-copy", st);
+    uint64_t total_ns = time_ns() - start_ns;
+
+    _slot.set_dirty_logging(false);
+
+    printf("converged:       %s\n", done ? "yes" : "no");
+    printf("total bytes:     %llu\n", (unsigned long long)_bytes_copied);
+    printf("total time:      %llu ns\n", (unsigned long long)total_ns);
+    printf("downtime:        %llu ns\n",
+           (unsigned long long)(st.harvest_ns + st.copy_ns));
+}
+
+bool migration::verify() const
+{
+    return memcmp(_dest, _slot.hva(), _slot.size()) == 0;
+}
+
+void start_migration(migration& mig, volatile bool& running,
+                     volatile bool& stopped, volatile int& round)
+{
+    mig.run(running, stopped, round);
+}
+
+uint64_t parse_number(char opt, const char* arg)
+{
+    char *endptr;
+
+    errno = 0;
+    uint64_t n = strtoull(arg, &endptr, 0);
+    if (errno || endptr == arg) {
+        printf("migration-sim: Invalid number: -%c %s\n", opt, arg);
+        exit(1);
+    }
+    if (*endptr == 'k' || *endptr == 'K') {
+        n *= 1024;
+    }
+    return n;
+}
+
+void parse_options(int ac, char **av)
+{
+    int opt;
+    char *endptr;
+
+    while ((opt = getopt(ac, av, "n:b:t:r:d:p:s:z:")) != -1) {
+        switch (opt) {
+        case 'n':
+            nr_slot_pages = parse_number(opt, optarg);
+            break;
+        case 'b':
+            bandwidth = parse_number(opt, optarg) << 20;
+            break;
+        case 't':
+            max_downtime_ns = parse_number(opt, optarg) * 1000000ULL;
+            break;
+        case 'r':
+            max_rounds = parse_number(opt, optarg);
+            break;
+        case 'd':
+            guest_delay = parse_number(opt, optarg);
+            break;
+        case 'p':
+            pattern_name = optarg;
+            break;
+        case 's':
+            pattern_seed = parse_number(opt, optarg);
+            break;
+        case 'z':
+            errno = 0;
+            zipf_skew = strtod(optarg, &endptr);
+            if (errno || endptr == optarg || zipf_skew < 0) {
+                printf("migration-sim: Invalid skew: -z %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            printf("usage: migration-sim [-n pages] [-b MB/s] [-t ms] "
+                   "[-r rounds] [-d delay] [-p pattern] [-s seed] "
+                   "[-z skew]\n");
+            exit(1);
+        }
+    }
+
+    if (nr_slot_pages <= 0) {
+        printf("migration-sim: Invalid setting: %lld slot pages\n",
+               (long long)nr_slot_pages);
+        exit(1);
+    }
+    printf("migration-sim: %lld pages, bandwidth %llu MB/s, "
+           "max downtime %llu ms, max rounds %d\n",
+           (long long)nr_slot_pages, (unsigned long long)(bandwidth >> 20),
+           (unsigned long long)(max_downtime_ns / 1000000), max_rounds);
+    printf("migration-sim: pattern %s, seed %llu, zipf skew %g, "
+           "guest delay %u\n", pattern_name.c_str(),
+           (unsigned long long)pattern_seed, zipf_skew, guest_delay);
+}
+
+}
+
+using boost::ref;
+using std::tr1::bind;
+
+int test_main(int ac, char **av)
+{
+    parse_options(ac, av);
+
+    pattern::generator_ptr gen = pattern::create(pattern_name, nr_slot_pages,
+                                                 pattern_seed, zipf_skew);
+    if (!gen) {
+        printf("migration-sim: Unknown pattern %s (one of: %s)\n",
+               pattern_name.c_str(), pattern::names);
+        return 1;
+    }
+    gen->start(nr_slot_pages);
+
+    kvm::system sys;
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+
+    void* mem_head;
+    uint64_t mem_size = nr_slot_pages * page_size;
+    if (posix_memalign(&mem_head, page_size, mem_size)) {
+        printf("migration-sim: Could not allocate guest memory.\n");
+        return 1;
+    }
+    std::vector<char> dest(mem_size);
+
+    identity::hole hole(mem_head, mem_size);
+    identity::vm ident_vm(vm, memmap, hole);
+    kvm::vcpu vcpu(vm, 0);
+    mem_slot slot(memmap, reinterpret_cast<uint64_t>(mem_head), mem_size,
+                  mem_head);
+
+    bool running = true;
+    bool stopped = false;
+    int round = 0;
+    migration mig(slot, &dest[0]);
+    boost::thread migration_thread(start_migration, ref(mig), ref(running),
+                                   ref(stopped), ref(round));
+    identity::vcpu guest_thread(vcpu, bind(dirty_mem, ref(running),
+                                           ref(stopped), ref(round),
+                                           mem_head, ref(*gen)));
+    vcpu.run();
+    migration_thread.join();
+
+    bool ok = mig.verify();
+    printf("destination %s source\n", ok ? "matches" : "DIFFERS FROM");
+    return ok ? 0 : 1;
+}
+
+int main(int ac, char **av)
+{
+    return try_main(test_main, ac, av);
+}
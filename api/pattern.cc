@@ -0,0 +1,154 @@
+
+#include "pattern.hh"
+#include <algorithm>
+#include <math.h>
+
+namespace pattern {
+
+namespace {
+
+// cdf values are fractions scaled by 2^53 so they stay exact in a double
+// and can be compared against random numbers without touching the FPU
+// from the guest.
+const int cdf_bits = 53;
+
+}
+
+const char *names = "sequential, strided, random, rewrite, zipf";
+
+rng::rng(uint64_t s)
+{
+    seed(s);
+}
+
+void rng::seed(uint64_t s)
+{
+    _state = s ^ 0x9e3779b97f4a7c15ULL;
+    if (!_state) {
+        _state = 1;
+    }
+}
+
+// xorshift64*
+uint64_t rng::next()
+{
+    _state ^= _state >> 12;
+    _state ^= _state << 25;
+    _state ^= _state >> 27;
+    return _state * 2685821657736338717ULL;
+}
+
+generator::generator(uint64_t nr_pages)
+    : _nr_pages(nr_pages)
+{
+}
+
+generator::~generator()
+{
+}
+
+void generator::start(uint64_t nr_accesses)
+{
+}
+
+sequential::sequential(uint64_t nr_pages)
+    : generator(nr_pages), _cursor(0)
+{
+}
+
+uint64_t sequential::next()
+{
+    uint64_t page = _cursor;
+    if (++_cursor == _nr_pages) {
+        _cursor = 0;
+    }
+    return page;
+}
+
+strided::strided(uint64_t nr_pages)
+    : generator(nr_pages), _stride(1), _cursor(0)
+{
+}
+
+void strided::start(uint64_t nr_accesses)
+{
+    _stride = nr_accesses ? _nr_pages / nr_accesses : 1;
+    if (!_stride) {
+        _stride = 1;
+    }
+    _cursor = 0;
+}
+
+uint64_t strided::next()
+{
+    uint64_t page = _cursor;
+    _cursor = (_cursor + _stride) % _nr_pages;
+    return page;
+}
+
+uniform::uniform(uint64_t nr_pages, uint64_t seed)
+    : generator(nr_pages), _rng(seed), _seed(seed)
+{
+}
+
+uint64_t uniform::next()
+{
+    return _rng.next(_nr_pages);
+}
+
+rewrite::rewrite(uint64_t nr_pages, uint64_t seed)
+    : uniform(nr_pages, seed)
+{
+}
+
+void rewrite::start(uint64_t nr_accesses)
+{
+    _rng.seed(_seed);
+}
+
+zipf::zipf(uint64_t nr_pages, uint64_t seed, double skew)
+    : generator(nr_pages), _rng(seed), _cdf(nr_pages)
+{
+    double total = 0;
+    for (uint64_t i = 0; i < nr_pages; ++i) {
+        total += 1.0 / pow(i + 1, skew);
+    }
+    double scale = ldexp(1.0, cdf_bits) / total;
+    double sum = 0;
+    for (uint64_t i = 0; i < nr_pages; ++i) {
+        sum += 1.0 / pow(i + 1, skew);
+        _cdf[i] = static_cast<uint64_t>(sum * scale);
+    }
+    if (nr_pages) {
+        _cdf[nr_pages - 1] = 1ULL << cdf_bits;
+    }
+}
+
+uint64_t zipf::next()
+{
+    uint64_t r = _rng.next() >> (64 - cdf_bits);
+    uint64_t page = std::upper_bound(_cdf.begin(), _cdf.end(), r)
+        - _cdf.begin();
+    return std::min(page, _nr_pages - 1);
+}
+
+generator_ptr create(std::string name, uint64_t nr_pages,
+                     uint64_t seed, double skew)
+{
+    generator* gen = NULL;
+
+    if (name == "sequential") {
+        gen = new sequential(nr_pages);
+    } else if (name == "strided") {
+        gen = new strided(nr_pages);
+    } else if (name == "random") {
+        gen = new uniform(nr_pages, seed);
+    } else if (name == "rewrite") {
+        gen = new rewrite(nr_pages, seed);
+    } else if (name == "zipf") {
+        gen = new zipf(nr_pages, seed, skew);
+    }
+    return generator_ptr(gen);
+}
+
+}
@@ -0,0 +1,97 @@
+#ifndef PATTERN_HH
+#define PATTERN_HH
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+// Guest memory access pattern generators.
+//
+// A generator hands out page numbers in [0, nr_pages).  start() is called
+// before each batch of accesses and next() for every access.  Both may run
+// in guest context, so they must not allocate memory or make system calls.
+
+namespace pattern {
+
+class rng {
+public:
+    explicit rng(uint64_t seed = 1);
+    void seed(uint64_t seed);
+    uint64_t next();
+    uint64_t next(uint64_t bound) { return next() % bound; }
+private:
+    uint64_t _state;
+};
+
+class generator {
+public:
+    explicit generator(uint64_t nr_pages);
+    virtual ~generator();
+    virtual void start(uint64_t nr_accesses);
+    virtual uint64_t next() = 0;
+    uint64_t nr_pages() const { return _nr_pages; }
+protected:
+    uint64_t _nr_pages;
+};
+
+// Streams through the range, carrying on where the last batch stopped.
+class sequential : public generator {
+public:
+    explicit sequential(uint64_t nr_pages);
+    virtual uint64_t next();
+private:
+    uint64_t _cursor;
+};
+
+// Spreads each batch evenly over the whole range, starting at page 0.
+class strided : public generator {
+public:
+    explicit strided(uint64_t nr_pages);
+    virtual void start(uint64_t nr_accesses);
+    virtual uint64_t next();
+private:
+    uint64_t _stride;
+    uint64_t _cursor;
+};
+
+// Uniformly random pages; the sequence continues across batches.
+class uniform : public generator {
+public:
+    uniform(uint64_t nr_pages, uint64_t seed);
+    virtual uint64_t next();
+protected:
+    rng _rng;
+    uint64_t _seed;
+};
+
+// Uniformly random pages, but every batch replays the same sequence, so
+// the guest keeps rewriting the same working set.
+class rewrite : public uniform {
+public:
+    rewrite(uint64_t nr_pages, uint64_t seed);
+    virtual void start(uint64_t nr_accesses);
+};
+
+// Zipf-distributed pages: page k is hit with probability proportional
+// to 1 / (k + 1)^skew, so the hot set sits at the start of the range.
+class zipf : public generator {
+public:
+    zipf(uint64_t nr_pages, uint64_t seed, double skew);
+    virtual uint64_t next();
+private:
+    rng _rng;
+    std::vector<uint64_t> _cdf;
+};
+
+typedef std::tr1::shared_ptr<generator> generator_ptr;
+
+// Returns a null pointer if name is not a known pattern.
+generator_ptr create(std::string name, uint64_t nr_pages,
+                     uint64_t seed = 1, double skew = 1.0);
+
+extern const char *names;
+
+}
+
+#endif
@@ -0,0 +1,10 @@
+PREFIX=/usr/local
+KERNELDIR=
+ARCH=x86_64
+PROCESSOR=x86_64
+CC=gcc
+LD=ld
+OBJCOPY=objcopy
+AR=ar
+API=
+TEST_DIR=x86
@@ -11,6 +11,8 @@ cflatobjs += lib/x86/atomic.o
 cflatobjs += lib/x86/desc.o
 cflatobjs += lib/x86/isr.o
 cflatobjs += lib/x86/pci.o
+cflatobjs += lib/x86/tsc.o
+cflatobjs += lib/x86/kvm_para.o
 
 $(libcflat): LDFLAGS += -nostdlib
 $(libcflat): CFLAGS += -ffreestanding -I lib
@@ -35,12 +37,18 @@ tests-common = $(TEST_DIR)/vmexit.flat $(TEST_DIR)/tsc.flat \
                $(TEST_DIR)/kvmclock_test.flat  $(TEST_DIR)/eventinj.flat \
                $(TEST_DIR)/s3.flat $(TEST_DIR)/pmu.flat \
                $(TEST_DIR)/tsc_adjust.flat $(TEST_DIR)/asyncpf.flat \
-               $(TEST_DIR)/init.flat $(TEST_DIR)/smap.flat
+               $(TEST_DIR)/init.flat $(TEST_DIR)/smap.flat \
+               $(TEST_DIR)/tlbshootdown.flat $(TEST_DIR)/tsc_sync.flat \
+               $(TEST_DIR)/apic_timer.flat $(TEST_DIR)/intr_latency.flat \
+               $(TEST_DIR)/apic_access.flat $(TEST_DIR)/halt_wakeup.flat \
+               $(TEST_DIR)/lockbench.flat $(TEST_DIR)/fwcfg_test.flat
 
 ifdef API
 tests-common += api/api-sample
 tests-common += api/dirty-log
 tests-common += api/dirty-log-perf
+tests-common += api/migration-sim
+tests-common += api/kick-latency
 endif
 
 tests_and_config = $(TEST_DIR)/*.flat $(TEST_DIR)/unittests.cfg
@@ -101,20 +109,39 @@ $(TEST_DIR)/pcid.elf: $(cstart.o) $(TEST_DIR)/pcid.o
 
 $(TEST_DIR)/smap.elf: $(cstart.o) $(TEST_DIR)/smap.o
 
+$(TEST_DIR)/tlbshootdown.elf: $(cstart.o) $(TEST_DIR)/tlbshootdown.o
+
+$(TEST_DIR)/tsc_sync.elf: $(cstart.o) $(TEST_DIR)/tsc_sync.o
+
+$(TEST_DIR)/apic_timer.elf: $(cstart.o) $(TEST_DIR)/apic_timer.o
+
+$(TEST_DIR)/intr_latency.elf: $(cstart.o) $(TEST_DIR)/intr_latency.o
+
+$(TEST_DIR)/apic_access.elf: $(cstart.o) $(TEST_DIR)/apic_access.o
+
+$(TEST_DIR)/halt_wakeup.elf: $(cstart.o) $(TEST_DIR)/halt_wakeup.o
+
+$(TEST_DIR)/lockbench.elf: $(cstart.o) $(TEST_DIR)/lockbench.o
+
+$(TEST_DIR)/fwcfg_test.elf: $(cstart.o) $(TEST_DIR)/fwcfg_test.o
+
 $(TEST_DIR)/vmx.elf: $(cstart.o) $(TEST_DIR)/vmx.o $(TEST_DIR)/vmx_tests.o
 
 $(TEST_DIR)/debug.elf: $(cstart.o) $(TEST_DIR)/debug.o
 
+$(TEST_DIR)/tlbbench.elf: $(cstart.o) $(TEST_DIR)/tlbbench.o
+
 arch_clean:
 	$(RM) $(TEST_DIR)/*.o $(TEST_DIR)/*.flat $(TEST_DIR)/*.elf \
 	$(TEST_DIR)/.*.d lib/x86/.*.d
 
 api/%.o: CFLAGS += -m32
 
-api/%: LDLIBS += -lstdc++ -lboost_thread-mt -lpthread -lrt
+api/%: LDLIBS += -lstdc++ -lboost_thread-mt -lpthread -lrt -lm
 api/%: LDFLAGS += -m32
 
-api/libapi.a: api/kvmxx.o api/identity.o api/exception.o api/memmap.o
+api/libapi.a: api/kvmxx.o api/identity.o api/exception.o api/memmap.o \
+		api/pattern.o
 	$(AR) rcs $@ $^
 
 api/api-sample: api/api-sample.o api/libapi.a
@@ -122,3 +149,7 @@ api/api-sample: api/api-sample.o api/libapi.a
 api/dirty-log: api/dirty-log.o api/libapi.a
 
 api/dirty-log-perf: api/dirty-log-perf.o api/libapi.a
+
+api/migration-sim: api/migration-sim.o api/libapi.a
+
+api/kick-latency: api/kick-latency.o api/libapi.a
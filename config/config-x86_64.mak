@@ -6,7 +6,8 @@ CFLAGS += -D__x86_64__ -mno-red-zone
 tests = $(TEST_DIR)/access.flat $(TEST_DIR)/apic.flat \
 	  $(TEST_DIR)/emulator.flat $(TEST_DIR)/idt_test.flat \
 	  $(TEST_DIR)/xsave.flat $(TEST_DIR)/rmap_chain.flat \
-	  $(TEST_DIR)/pcid.flat $(TEST_DIR)/debug.flat
+	  $(TEST_DIR)/pcid.flat $(TEST_DIR)/debug.flat \
+	  $(TEST_DIR)/tlbbench.flat
 tests += $(TEST_DIR)/svm.flat
 tests += $(TEST_DIR)/vmx.flat
 
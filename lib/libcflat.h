@@ -43,6 +43,8 @@ typedef _Bool		bool;
 #define true  1
 
 extern void puts(const char *s);
+extern void console_buffer(bool enable);
+extern void console_flush(void);
 extern void exit(int code);
 extern void abort(void);
 
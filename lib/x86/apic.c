@@ -1,6 +1,7 @@
 #include "libcflat.h"
 #include "apic.h"
 #include "msr.h"
+#include "processor.h"
 
 static void *g_apic = (void *)0xfee00000;
 static void *g_ioapic = (void *)0xfec00000;
@@ -117,6 +118,27 @@ int enable_x2apic(void)
     }
 }
 
+/* The mode is per cpu, so ask this cpu's APIC rather than apic_ops. */
+int x2apic_enabled(void)
+{
+    return !!(rdmsr(MSR_IA32_APICBASE) & APIC_EXTD);
+}
+
+/*
+ * Go back from x2APIC to xAPIC mode, which needs a pass through disabled.
+ * This only switches the calling cpu, while apic_ops is shared: run it on
+ * every cpu (e.g. with on_cpu()) before using the APIC from any of them.
+ */
+void reset_apic(void)
+{
+    u64 base = rdmsr(MSR_IA32_APICBASE);
+
+    wrmsr(MSR_IA32_APICBASE, base & ~(APIC_EN | APIC_EXTD));
+    wrmsr(MSR_IA32_APICBASE, (base & ~APIC_EXTD) | APIC_EN);
+    apic_ops = &xapic_ops;
+    xapic_write(APIC_SPIV, 0x1ff);
+}
+
 void ioapic_write_reg(unsigned reg, u32 value)
 {
     *(volatile u32 *)g_ioapic = reg;
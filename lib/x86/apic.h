@@ -30,5 +30,7 @@ void apic_icr_write(uint32_t val, uint32_t dest);
 uint32_t apic_id(void);
 
 int enable_x2apic(void);
+int x2apic_enabled(void);
+void reset_apic(void);
 
 #endif
@@ -159,6 +159,272 @@ static inline long atomic64_read(const atomic64_t *v)
 
 u64 atomic64_cmpxchg(atomic64_t *v, u64 old, u64 new);
 
+/**
+ * atomic64_set - set atomic64 variable
+ * @v: pointer to type atomic64_t
+ * @i: required value
+ */
+static inline void atomic64_set(atomic64_t *v, long long i)
+{
+	v->counter = i;
+}
+
+/**
+ * atomic64_fetch_add - add and return the old value
+ * @i: integer value to add
+ * @v: pointer to type atomic64_t
+ *
+ * Atomically adds @i to @v and returns the value @v had before.
+ */
+static inline long long atomic64_fetch_add(long long i, atomic64_t *v)
+{
+	asm volatile("lock xaddq %0, %1"
+		     : "+r" (i), "+m" (v->counter)
+		     : : "memory");
+	return i;
+}
+
+/**
+ * atomic64_add - add to atomic64 variable
+ * @i: integer value to add
+ * @v: pointer to type atomic64_t
+ */
+static inline void atomic64_add(long long i, atomic64_t *v)
+{
+	asm volatile("lock addq %1, %0"
+		     : "+m" (v->counter)
+		     : "er" (i));
+}
+
+#endif
+
+#define SMP_CACHE_BYTES		64
+#define ____cacheline_aligned	__attribute__((aligned(SMP_CACHE_BYTES)))
+
+/*
+ * Memory ordering.  x86 only reorders a store with a later load, so
+ * acquire loads, release stores, smp_rmb() and smp_wmb() only need to
+ * stop the compiler.  smp_mb() uses a locked add to the stack, which
+ * orders like mfence but is cheaper on most cpus.
+ */
+#define READ_ONCE(x)		(*(volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, val)	(*(volatile typeof(x) *)&(x) = (val))
+
+#define smp_rmb()		asm volatile("" : : : "memory")
+#define smp_wmb()		asm volatile("" : : : "memory")
+#ifdef __x86_64__
+#define smp_mb()		asm volatile("lock; addl $0, -4(%%rsp)" : : : "memory", "cc")
+#else
+#define smp_mb()		asm volatile("lock; addl $0, -4(%%esp)" : : : "memory", "cc")
 #endif
 
+#define smp_load_acquire(p)					\
+({								\
+	typeof(*(p)) ___v = READ_ONCE(*(p));			\
+	asm volatile("" : : : "memory");			\
+	___v;							\
+})
+
+#define smp_store_release(p, v)					\
+do {								\
+	asm volatile("" : : : "memory");			\
+	WRITE_ONCE(*(p), (v));					\
+} while (0)
+
+#define atomic_read_acquire(v)	smp_load_acquire(&(v)->counter)
+
+/**
+ * atomic_fetch_add - add and return the old value
+ * @i: integer value to add
+ * @v: pointer of type atomic_t
+ *
+ * Atomically adds @i to @v and returns the value @v had before.
+ */
+static inline int atomic_fetch_add(int i, atomic_t *v)
+{
+	asm volatile("lock xaddl %0, %1"
+		     : "+r" (i), "+m" (v->counter)
+		     : : "memory");
+	return i;
+}
+
+/**
+ * atomic_add - add integer to atomic variable
+ * @i: integer value to add
+ * @v: pointer of type atomic_t
+ */
+static inline void atomic_add(int i, atomic_t *v)
+{
+	asm volatile("lock addl %1, %0"
+		     : "+m" (v->counter)
+		     : "ir" (i));
+}
+
+/**
+ * atomic_sub - subtract integer from atomic variable
+ * @i: integer value to subtract
+ * @v: pointer of type atomic_t
+ */
+static inline void atomic_sub(int i, atomic_t *v)
+{
+	asm volatile("lock subl %1, %0"
+		     : "+m" (v->counter)
+		     : "ir" (i));
+}
+
+/**
+ * atomic_add_return - add integer and return the new value
+ * @i: integer value to add
+ * @v: pointer of type atomic_t
+ */
+static inline int atomic_add_return(int i, atomic_t *v)
+{
+	return atomic_fetch_add(i, v) + i;
+}
+
+#define atomic_inc_return(v)	atomic_add_return(1, v)
+#define atomic_dec_return(v)	atomic_add_return(-1, v)
+
+/**
+ * atomic_dec_and_test - decrement and test
+ * @v: pointer of type atomic_t
+ *
+ * Atomically decrements @v by 1 and returns true if the result is 0.
+ */
+static inline bool atomic_dec_and_test(atomic_t *v)
+{
+	unsigned char c;
+
+	asm volatile("lock decl %0; sete %1"
+		     : "+m" (v->counter), "=qm" (c)
+		     : : "memory");
+	return c;
+}
+
+/**
+ * atomic_xchg - exchange the value of an atomic variable
+ * @v: pointer of type atomic_t
+ * @new: new value
+ *
+ * Atomically sets @v to @new and returns the old value.
+ */
+static inline int atomic_xchg(atomic_t *v, int new)
+{
+	asm volatile("xchgl %0, %1"
+		     : "+r" (new), "+m" (v->counter)
+		     : : "memory");
+	return new;
+}
+
+/**
+ * atomic_cmpxchg - compare and exchange
+ * @v: pointer of type atomic_t
+ * @old: expected value
+ * @new: new value
+ *
+ * Atomically sets @v to @new if it was @old; returns the value @v had.
+ */
+static inline int atomic_cmpxchg(atomic_t *v, int old, int new)
+{
+	int ret;
+
+	asm volatile("lock cmpxchgl %2, %1"
+		     : "=a" (ret), "+m" (v->counter)
+		     : "r" (new), "0" (old)
+		     : "memory");
+	return ret;
+}
+
+/**
+ * test_and_set_bit - set a bit and return its old value
+ * @nr: bit to set
+ * @addr: address to count from
+ *
+ * Atomic, and a full barrier like every locked instruction.
+ */
+static inline bool test_and_set_bit(long nr, volatile unsigned long *addr)
+{
+	unsigned char c;
+
+	asm volatile("lock bts %2, %1; setc %0"
+		     : "=qm" (c), "+m" (*addr)
+		     : "r" (nr)
+		     : "memory");
+	return c;
+}
+
+/**
+ * test_and_clear_bit - clear a bit and return its old value
+ * @nr: bit to clear
+ * @addr: address to count from
+ */
+static inline bool test_and_clear_bit(long nr, volatile unsigned long *addr)
+{
+	unsigned char c;
+
+	asm volatile("lock btr %2, %1; setc %0"
+		     : "=qm" (c), "+m" (*addr)
+		     : "r" (nr)
+		     : "memory");
+	return c;
+}
+
+static inline void set_bit(long nr, volatile unsigned long *addr)
+{
+	asm volatile("lock bts %1, %0"
+		     : "+m" (*addr)
+		     : "r" (nr)
+		     : "memory");
+}
+
+static inline void clear_bit(long nr, volatile unsigned long *addr)
+{
+	asm volatile("lock btr %1, %0"
+		     : "+m" (*addr)
+		     : "r" (nr)
+		     : "memory");
+}
+
+static inline bool test_bit(long nr, const volatile unsigned long *addr)
+{
+	return (addr[nr / (8 * sizeof(long))] >> (nr % (8 * sizeof(long)))) & 1;
+}
+
+/*
+ * A counter that every cpu bumps in its own cache line without locked
+ * instructions; only the sum is meaningful.  A cpu must only touch its
+ * own slot.
+ */
+#define PERCPU_COUNTER_CPUS	64
+
+struct percpu_counter {
+	struct {
+		volatile unsigned long count;
+	} ____cacheline_aligned cpu[PERCPU_COUNTER_CPUS];
+};
+
+static inline void percpu_counter_add(struct percpu_counter *c, int cpu,
+				      unsigned long n)
+{
+	c->cpu[cpu].count += n;
+}
+
+static inline unsigned long percpu_counter_sum(struct percpu_counter *c)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i < PERCPU_COUNTER_CPUS; ++i)
+		sum += READ_ONCE(c->cpu[i].count);
+	return sum;
+}
+
+static inline void percpu_counter_reset(struct percpu_counter *c)
+{
+	int i;
+
+	for (i = 0; i < PERCPU_COUNTER_CPUS; ++i)
+		c->cpu[i].count = 0;
+}
+
 #endif
@@ -1,20 +1,134 @@
 #include "fwcfg.h"
 #include "smp.h"
+#include "io.h"
+#include "processor.h"
+#include "libcflat.h"
+
+/*
+ * Every PIO access to fw_cfg is an exit, so the data register costs one
+ * exit per byte.  When the host supports it, items are instead read with
+ * the DMA interface, which is two exits per transfer regardless of size.
+ * The fixed items below FW_CFG_MAX_ENTRY never change while the guest
+ * runs, so they are cached after the first read, as is the file directory.
+ */
+
+#define FWCFG_MAX_FILES 128
+
+struct fwcfg_dma_access {
+    uint32_t control;
+    uint32_t length;
+    uint64_t address;
+} __attribute__((packed));
+
+struct fwcfg_file {
+    uint32_t size;
+    uint16_t select;
+    uint16_t reserved;
+    char name[FW_CFG_MAX_FILE_PATH];
+} __attribute__((packed));
 
 static struct spinlock lock;
+static int has_dma = -1;
+
+static uint64_t values[FW_CFG_MAX_ENTRY];
+static volatile uint32_t values_valid;
+
+static struct fwcfg_file files[FWCFG_MAX_FILES];
+static uint32_t nr_files;
+static volatile int files_valid;
+
+static void fwcfg_select(uint16_t index)
+{
+    outw(index, BIOS_CFG_IOPORT);
+}
+
+static void fwcfg_pio_read(void *buf, uint32_t len)
+{
+    unsigned long n = len;
+
+    asm volatile ("rep/insb" : "+D"(buf), "+c"(n)
+                  : "d"((uint16_t)(BIOS_CFG_IOPORT + 1)) : "memory");
+}
+
+/*
+ * Read len bytes at the current offset, selecting index first if asked.
+ * Returns false if the host reported an error; buf is undefined then.
+ */
+static bool fwcfg_dma_read(int select, uint16_t index, void *buf,
+                           uint32_t len)
+{
+    /* guest memory is identity mapped, so virtual == physical here */
+    volatile struct fwcfg_dma_access access;
+    uint64_t addr = (unsigned long)&access;
+    uint32_t control = FW_CFG_DMA_CTL_READ;
+
+    if (select)
+        control |= FW_CFG_DMA_CTL_SELECT | ((uint32_t)index << 16);
+    access.control = __builtin_bswap32(control);
+    access.length = __builtin_bswap32(len);
+    access.address = __builtin_bswap64((unsigned long)buf);
+
+    barrier();
+    outl(__builtin_bswap32(addr >> 32), BIOS_CFG_DMA_IOPORT);
+    outl(__builtin_bswap32(addr), BIOS_CFG_DMA_IOPORT + 4);
+    while ((control = __builtin_bswap32(access.control))
+           & ~FW_CFG_DMA_CTL_ERROR)
+        barrier();
+    return !(control & FW_CFG_DMA_CTL_ERROR);
+}
+
+static void fwcfg_probe(void)
+{
+    uint32_t id = 0;
+
+    if (has_dma >= 0)
+        return;
+    fwcfg_select(FW_CFG_ID);
+    fwcfg_pio_read(&id, sizeof(id));
+    has_dma = !!(id & FW_CFG_VERSION_DMA);
+}
+
+/* Caller holds lock. */
+static void __fwcfg_read(uint16_t index, void *buf, uint32_t len)
+{
+    fwcfg_probe();
+    if (has_dma && fwcfg_dma_read(1, index, buf, len))
+        return;
+    fwcfg_select(index);
+    fwcfg_pio_read(buf, len);
+}
+
+void fwcfg_read(unsigned index, void *buf, uint32_t len)
+{
+    spin_lock(&lock);
+    __fwcfg_read(index, buf, len);
+    spin_unlock(&lock);
+}
 
 uint64_t fwcfg_get_u(uint16_t index, int bytes)
 {
     uint64_t r = 0;
-    uint8_t b;
-    int i;
 
-    spin_lock(&lock);
-    asm volatile ("out %0, %1" : : "a"(index), "d"((uint16_t)BIOS_CFG_IOPORT));
-    for (i = 0; i < bytes; ++i) {
-        asm volatile ("in %1, %0" : "=a"(b) : "d"((uint16_t)(BIOS_CFG_IOPORT + 1)));
-        r |= (uint64_t)b << (i * 8);
+    if (index < FW_CFG_MAX_ENTRY) {
+        if (!(values_valid & (1u << index))) {
+            spin_lock(&lock);
+            if (!(values_valid & (1u << index))) {
+                /* short items read back as zero past their end */
+                __fwcfg_read(index, &values[index], sizeof(values[index]));
+                barrier();
+                values_valid |= 1u << index;
+            }
+            spin_unlock(&lock);
+        }
+        barrier();
+        r = values[index];
+        if (bytes < 8)
+            r &= (1ull << (bytes * 8)) - 1;
+        return r;
     }
+
+    spin_lock(&lock);
+    __fwcfg_read(index, &r, bytes);
     spin_unlock(&lock);
     return r;
 }
@@ -43,3 +157,54 @@ unsigned fwcfg_get_nb_cpus(void)
 {
     return fwcfg_get_u16(FW_CFG_NB_CPUS);
 }
+
+/* Caller holds lock. */
+static void fwcfg_load_files(void)
+{
+    uint32_t count;
+
+    __fwcfg_read(FW_CFG_FILE_DIR, &count, sizeof(count));
+    count = __builtin_bswap32(count);
+    if (count > FWCFG_MAX_FILES) {
+        printf("fwcfg: %d files, only the first %d are visible\n",
+               count, FWCFG_MAX_FILES);
+        count = FWCFG_MAX_FILES;
+    }
+
+    /* the entries follow the count, so keep reading without reselecting */
+    if (!has_dma) {
+        fwcfg_pio_read(files, count * sizeof(files[0]));
+    } else if (!fwcfg_dma_read(0, 0, files, count * sizeof(files[0]))) {
+        /* the offset is unknown after an error: start over with PIO */
+        fwcfg_select(FW_CFG_FILE_DIR);
+        fwcfg_pio_read(&count, sizeof(count));
+        count = __builtin_bswap32(count);
+        if (count > FWCFG_MAX_FILES)
+            count = FWCFG_MAX_FILES;
+        fwcfg_pio_read(files, count * sizeof(files[0]));
+    }
+    nr_files = count;
+    barrier();
+    files_valid = 1;
+}
+
+unsigned fwcfg_find_file(const char *name, uint32_t *size)
+{
+    uint32_t i;
+
+    if (!files_valid) {
+        spin_lock(&lock);
+        if (!files_valid)
+            fwcfg_load_files();
+        spin_unlock(&lock);
+    }
+
+    for (i = 0; i < nr_files; ++i) {
+        if (strcmp(files[i].name, name) == 0) {
+            if (size)
+                *size = __builtin_bswap32(files[i].size);
+            return (files[i].select >> 8) | (files[i].select & 0xff) << 8;
+        }
+    }
+    return FW_CFG_INVALID;
+}
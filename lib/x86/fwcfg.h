@@ -20,6 +20,7 @@
 #define FW_CFG_BOOT_MENU        0x0e
 #define FW_CFG_MAX_CPUS         0x0f
 #define FW_CFG_MAX_ENTRY        0x10
+#define FW_CFG_FILE_DIR         0x19
 
 #define FW_CFG_WRITE_CHANNEL    0x4000
 #define FW_CFG_ARCH_LOCAL       0x8000
@@ -28,6 +29,19 @@
 #define FW_CFG_INVALID          0xffff
 
 #define BIOS_CFG_IOPORT 0x510
+#define BIOS_CFG_DMA_IOPORT 0x514
+
+/* FW_CFG_ID bits */
+#define FW_CFG_VERSION          0x01
+#define FW_CFG_VERSION_DMA      0x02
+
+/* FWCfgDmaAccess control bits */
+#define FW_CFG_DMA_CTL_ERROR    0x01
+#define FW_CFG_DMA_CTL_READ     0x02
+#define FW_CFG_DMA_CTL_SKIP     0x04
+#define FW_CFG_DMA_CTL_SELECT   0x08
+
+#define FW_CFG_MAX_FILE_PATH    56
 
 #define FW_CFG_ACPI_TABLES (FW_CFG_ARCH_LOCAL + 0)
 #define FW_CFG_SMBIOS_ENTRIES (FW_CFG_ARCH_LOCAL + 1)
@@ -40,5 +54,18 @@ uint64_t fwcfg_get_u64(unsigned index);
 
 unsigned fwcfg_get_nb_cpus(void);
 
+/*
+ * Copy len bytes of an item into buf, using the DMA interface when the
+ * host offers it.  Reads past the end of the item return zeroes.
+ */
+void fwcfg_read(unsigned index, void *buf, uint32_t len);
+
+/*
+ * Look a file up by name ("etc/acpi/tables", ...) in the fw_cfg file
+ * directory.  Returns the item's selector, or FW_CFG_INVALID if there is
+ * no such file; *size, if not NULL, receives the file's length.
+ */
+unsigned fwcfg_find_file(const char *name, uint32_t *size);
+
 #endif
 
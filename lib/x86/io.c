@@ -5,9 +5,29 @@
 #define USE_SERIAL
 #endif
 
+#define LOG_BUF_SIZE	4096
+#define LOG_MAX_CPUS	64
+#define UART_FIFO_SIZE	16
+
+/*
+ * Buffered console: each cpu appends to its own log buffer without
+ * locking, and only its owner writes it out, under the console lock,
+ * when it fills up or on console_flush().  exit() writes out whatever
+ * every cpu has left.
+ *
+ * The UART is paced: one LSR read and one rep/outsb per FIFO's worth,
+ * so a full 4k buffer costs about 512 exits instead of one per byte.
+ */
+struct log_buf {
+	unsigned long len;
+	char buf[LOG_BUF_SIZE];
+} __attribute__((aligned(64)));
+
 static struct spinlock lock;
 static int serial_iobase = 0x3f8;
 static int serial_inited = 0;
+static bool log_buffered;
+static struct log_buf log_bufs[LOG_MAX_CPUS];
 
 static void serial_outb(char ch)
 {
@@ -37,6 +57,12 @@ static void serial_init(void)
         lcr = inb(serial_iobase + 0x03);
         lcr &= ~0x80;
         outb(lcr, serial_iobase + 0x03);
+
+        /*
+         * enable and clear the FIFOs; serial_outb() still waits for THRE,
+         * which now means an empty FIFO, before every byte
+         */
+        outb(0x07, serial_iobase + 0x02);
 }
 
 static void print_serial(const char *buf)
@@ -57,8 +83,99 @@ static void print_serial(const char *buf)
 #endif
 }
 
+static void print_bulk(const char *buf, unsigned long len)
+{
+#ifdef USE_SERIAL
+        unsigned long n;
+
+        if (!serial_inited) {
+            serial_init();
+            serial_inited = 1;
+        }
+
+        while (len) {
+            n = len < UART_FIFO_SIZE ? len : UART_FIFO_SIZE;
+            len -= n;
+            /* with the FIFOs on, THRE means the transmit FIFO is empty */
+            while (!(inb(serial_iobase + 0x05) & 0x20))
+                ;
+            asm volatile ("rep/outsb" : "+S"(buf), "+c"(n)
+                          : "d"(serial_iobase) : "memory");
+        }
+#else
+        asm volatile ("rep/outsb" : "+S"(buf), "+c"(len)
+                      : "d"(0xf1) : "memory");
+#endif
+}
+
+static void log_write(struct log_buf *log)
+{
+	if (!log->len)
+		return;
+	print_bulk(log->buf, log->len);
+	log->len = 0;
+}
+
+/* Only for the calling cpu's own buffer. */
+static void log_flush(struct log_buf *log)
+{
+	if (!log->len)
+		return;
+	spin_lock(&lock);
+	log_write(log);
+	spin_unlock(&lock);
+}
+
+static void log_puts(const char *s)
+{
+	struct log_buf *log = &log_bufs[smp_id() % LOG_MAX_CPUS];
+	unsigned long len = strlen(s);
+
+	while (len) {
+		unsigned long n = LOG_BUF_SIZE - log->len;
+
+		if (n > len)
+			n = len;
+		memcpy(log->buf + log->len, s, n);
+		log->len += n;
+		s += n;
+		len -= n;
+		if (log->len == LOG_BUF_SIZE)
+			log_flush(log);
+	}
+}
+
+/* Writes out the calling cpu's buffer; the others' wait for exit(). */
+void console_flush(void)
+{
+	log_flush(&log_bufs[smp_id() % LOG_MAX_CPUS]);
+}
+
+/*
+ * exit() may be reached with the console lock held, e.g. from a fault
+ * in puts(), so write the buffers out without it.
+ */
+static void console_flush_all(void)
+{
+	int i;
+
+	for (i = 0; i < LOG_MAX_CPUS; i++)
+		log_write(&log_bufs[i]);
+}
+
+void console_buffer(bool enable)
+{
+	log_buffered = enable;
+	if (!enable)
+		console_flush();
+}
+
 void puts(const char *s)
 {
+	if (log_buffered) {
+		log_puts(s);
+		return;
+	}
 	spin_lock(&lock);
 	print_serial(s);
 	spin_unlock(&lock);
@@ -70,6 +187,8 @@ void exit(int code)
         static const char shutdown_str[8] = "Shutdown";
         int i;
 
+        console_flush_all();
+
         /* test device exit (with status) */
         outl(code, 0xf4);
 
@@ -78,6 +197,7 @@ void exit(int code)
                 outb(shutdown_str[i], 0x8900);
         }
 #else
+        console_flush_all();
         asm volatile("out %0, %1" : : "a"(code), "d"((short)0xf4));
 #endif
 }
@@ -0,0 +1,50 @@
+#include "libcflat.h"
+#include "processor.h"
+#include "kvm_para.h"
+
+static int vmcall = -1;
+
+static bool use_vmcall(void)
+{
+	if (vmcall < 0)
+		vmcall = cpuid(0).b == CPUID_VENDOR_INTEL;
+	return vmcall;
+}
+
+bool kvm_para_available(void)
+{
+	struct cpuid sig = cpuid(KVM_CPUID_SIGNATURE);
+
+	/* "KVMKVMKVM\0\0\0" */
+	return sig.b == 0x4b4d564b && sig.c == 0x564b4d56 && sig.d == 0x4d;
+}
+
+u32 kvm_features(void)
+{
+	if (!kvm_para_available())
+		return 0;
+	return cpuid(KVM_CPUID_FEATURES).a;
+}
+
+long kvm_hypercall4(unsigned nr, unsigned long p1, unsigned long p2,
+		    unsigned long p3, unsigned long p4)
+{
+	long ret;
+
+	if (use_vmcall())
+		asm volatile(KVM_HYPERCALL_INTEL
+			     : "=a"(ret)
+			     : "a"(nr), "b"(p1), "c"(p2), "d"(p3), "S"(p4)
+			     : "memory");
+	else
+		asm volatile(KVM_HYPERCALL_AMD
+			     : "=a"(ret)
+			     : "a"(nr), "b"(p1), "c"(p2), "d"(p3), "S"(p4)
+			     : "memory");
+	return ret;
+}
+
+long kvm_hypercall2(unsigned nr, unsigned long p1, unsigned long p2)
+{
+	return kvm_hypercall4(nr, p1, p2, 0, 0);
+}
@@ -0,0 +1,35 @@
+#ifndef KVM_PARA_H
+#define KVM_PARA_H
+
+#include "libcflat.h"
+
+#define KVM_HYPERCALL_INTEL ".byte 0x0f,0x01,0xc1"	/* vmcall */
+#define KVM_HYPERCALL_AMD ".byte 0x0f,0x01,0xd9"	/* vmmcall */
+
+#define KVM_CPUID_SIGNATURE	0x40000000
+#define KVM_CPUID_FEATURES	0x40000001
+
+#define KVM_FEATURE_STEAL_TIME	5
+#define KVM_FEATURE_PV_UNHALT	7
+#define KVM_FEATURE_PV_TLB_FLUSH 9
+#define KVM_FEATURE_PV_SEND_IPI	11
+
+#define KVM_HC_VAPIC_POLL_IRQ	1
+#define KVM_HC_KICK_CPU		5
+#define KVM_HC_SEND_IPI		10
+
+#define CPUID_VENDOR_INTEL	0x756e6547	/* "Genu" */
+
+bool kvm_para_available(void);
+/* KVM_CPUID_FEATURES eax, or 0 when not running on KVM */
+u32 kvm_features(void);
+
+/*
+ * Hypercalls through the CPU's native instruction, so that KVM does not
+ * have to patch the call site.
+ */
+long kvm_hypercall2(unsigned nr, unsigned long p1, unsigned long p2);
+long kvm_hypercall4(unsigned nr, unsigned long p1, unsigned long p2,
+		    unsigned long p3, unsigned long p4);
+
+#endif
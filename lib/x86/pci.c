@@ -12,44 +12,337 @@ static unsigned inl(unsigned short port)
     asm volatile("inl %w1, %0" : "=a"(data) : "Nd"(port));
     return data;
 }
-static uint32_t pci_config_read(pcidevaddr_t dev, uint8_t reg)
+
+struct acpi_table_header {
+    u32 signature;
+    u32 length;
+    u8  revision;
+    u8  checksum;
+    u8  oem_id[6];
+    u8  oem_table_id[8];
+    u32 oem_revision;
+    u8  asl_compiler_id[4];
+    u32 asl_compiler_revision;
+} __attribute__((packed));
+
+struct acpi_rsdp {
+    u64 signature;
+    u8  checksum;
+    u8  oem_id[6];
+    u8  revision;
+    u32 rsdt_physical_address;
+} __attribute__((packed));
+
+struct acpi_mcfg_allocation {
+    u64 address;
+    u16 segment;
+    u8  start_bus;
+    u8  end_bus;
+    u32 reserved;
+} __attribute__((packed));
+
+#define RSDP_SIGNATURE  0x2052545020445352ull   /* "RSD PTR " */
+#define RSDT_SIGNATURE  0x54445352              /* RSDT */
+#define MCFG_SIGNATURE  0x4746434d              /* MCFG */
+
+static volatile u8 *ecam_base;
+static u8 ecam_start_bus, ecam_end_bus;
+
+static struct pci_dev pci_devs[PCI_MAX_DEVS];
+static int nr_pci_devs;
+static int pci_hash[64];            /* index + 1 of the first device */
+static bool pci_initialized;
+
+uint32_t pci_config_readl_pio(pcidevaddr_t dev, uint8_t reg)
 {
-    uint32_t index = reg | (dev << 8) | (0x1 << 31); 
+    uint32_t index = (reg & ~3) | (dev << 8) | (0x1u << 31);
     outl(0xCF8, index);
     return inl(0xCFC);
 }
 
-/* Scan bus look for a specific device. Only bus 0 scanned for now. */
-pcidevaddr_t pci_find_dev(uint16_t vendor_id, uint16_t device_id)
+static void pci_config_writel_pio(pcidevaddr_t dev, uint8_t reg,
+                                  uint32_t val)
+{
+    uint32_t index = (reg & ~3) | (dev << 8) | (0x1u << 31);
+    outl(0xCF8, index);
+    outl(0xCFC, val);
+}
+
+static volatile uint32_t *ecam_addr(pcidevaddr_t dev, uint16_t reg)
+{
+    return (volatile uint32_t *)(ecam_base
+                                 + ((dev - (ecam_start_bus << 8)) << 12)
+                                 + (reg & ~3));
+}
+
+static bool ecam_covers(pcidevaddr_t dev)
+{
+    return ecam_base && (dev >> 8) >= ecam_start_bus
+        && (dev >> 8) <= ecam_end_bus;
+}
+
+uint32_t pci_config_readl_ecam(pcidevaddr_t dev, uint16_t reg)
+{
+    return *ecam_addr(dev, reg);
+}
+
+bool pci_ecam_enabled(void)
+{
+    pci_init();
+    return ecam_base;
+}
+
+uint32_t pci_config_readl(pcidevaddr_t dev, uint16_t reg)
+{
+    if (ecam_covers(dev))
+        return pci_config_readl_ecam(dev, reg);
+    return pci_config_readl_pio(dev, reg);
+}
+
+void pci_config_writel(pcidevaddr_t dev, uint16_t reg, uint32_t val)
+{
+    if (ecam_covers(dev))
+        *ecam_addr(dev, reg) = val;
+    else
+        pci_config_writel_pio(dev, reg, val);
+}
+
+/*
+ * The ECAM window is only usable if it sits in the 1:1 mapped MMIO range
+ * that setup_vm() leaves in place: below 4G on x86_64, 3G-4G on i386.
+ */
+static bool ecam_mapped(u64 base, u64 size)
+{
+#ifdef __x86_64__
+    return base + size <= (1ull << 32);
+#else
+    return base >= (3ull << 30) && base + size <= (1ull << 32);
+#endif
+}
+
+static void pci_find_ecam(void)
+{
+    struct acpi_rsdp *rsdp;
+    struct acpi_table_header *rsdt, *table;
+    struct acpi_mcfg_allocation *mcfg;
+    u32 *entry, *end;
+    unsigned long addr;
+    u64 size;
+
+    for (addr = 0xe0000; addr < 0x100000; addr += 16) {
+        rsdp = (void *)addr;
+        if (rsdp->signature == RSDP_SIGNATURE)
+            break;
+    }
+    if (addr == 0x100000)
+        return;
+
+    rsdt = (void *)(ulong)rsdp->rsdt_physical_address;
+    if (!rsdt || rsdt->signature != RSDT_SIGNATURE)
+        return;
+
+    entry = (void *)(rsdt + 1);
+    end = (void *)rsdt + rsdt->length;
+    for (; entry < end; ++entry) {
+        table = (void *)(ulong)*entry;
+        if (!table || table->signature != MCFG_SIGNATURE)
+            continue;
+        /* 8 reserved bytes follow the header */
+        mcfg = (void *)(table + 1) + 8;
+        if ((void *)(mcfg + 1) > (void *)table + table->length
+            || mcfg->segment)
+            return;
+        size = (u64)(mcfg->end_bus - mcfg->start_bus + 1) << 20;
+        if (!ecam_mapped(mcfg->address, size))
+            return;
+        ecam_base = (void *)(ulong)mcfg->address;
+        ecam_start_bus = mcfg->start_bus;
+        ecam_end_bus = mcfg->end_bus;
+        return;
+    }
+}
+
+static int pci_hash_key(uint16_t vendor_id, uint16_t device_id)
+{
+    return (vendor_id ^ device_id ^ (device_id >> 6)) & 63;
+}
+
+/* Size a BAR by writing all ones with decoding off; returns the next BAR. */
+static int pci_probe_bar(struct pci_dev *pdev, int num)
+{
+    struct pci_bar *bar = &pdev->bar[num];
+    uint16_t reg = PCI_BASE_ADDRESS_0 + num * 4;
+    uint32_t orig, mask, orig_hi = 0, mask_hi = ~0u;
+
+    orig = pci_config_readl(pdev->bdf, reg);
+    pci_config_writel(pdev->bdf, reg, ~0u);
+    mask = pci_config_readl(pdev->bdf, reg);
+    pci_config_writel(pdev->bdf, reg, orig);
+    if (!mask)
+        return num + 1;
+
+    if (orig & PCI_BASE_ADDRESS_SPACE_IO) {
+        bar->io = true;
+        bar->addr = orig & PCI_BASE_ADDRESS_IO_MASK;
+        bar->size = ~(mask & PCI_BASE_ADDRESS_IO_MASK) + 1;
+        bar->size &= 0xffff;
+        return num + 1;
+    }
+
+    if ((orig & PCI_BASE_ADDRESS_MEM_TYPE_MASK)
+        == PCI_BASE_ADDRESS_MEM_TYPE_64 && num + 1 < PCI_BAR_NUM) {
+        bar->is64 = true;
+        orig_hi = pci_config_readl(pdev->bdf, reg + 4);
+        pci_config_writel(pdev->bdf, reg + 4, ~0u);
+        mask_hi = pci_config_readl(pdev->bdf, reg + 4);
+        pci_config_writel(pdev->bdf, reg + 4, orig_hi);
+    }
+    bar->addr = ((u64)orig_hi << 32) | (orig & PCI_BASE_ADDRESS_MEM_MASK);
+    bar->size = ~(((u64)mask_hi << 32) | (mask & PCI_BASE_ADDRESS_MEM_MASK))
+                + 1;
+    return num + (bar->is64 ? 2 : 1);
+}
+
+static void pci_add_dev(pcidevaddr_t bdf, uint32_t id, uint8_t header_type)
 {
-    unsigned dev;
-    for (dev = 0; dev < 256; ++dev) {
-    uint32_t id = pci_config_read(dev, 0);
-    if ((id & 0xFFFF) == vendor_id && (id >> 16) == device_id) {
-        return dev;
+    struct pci_dev *pdev;
+    uint32_t cmd;
+    int num, key;
+
+    if (nr_pci_devs == PCI_MAX_DEVS) {
+        printf("pci: more than %d devices, ignoring %x\n", PCI_MAX_DEVS, bdf);
+        return;
     }
+    pdev = &pci_devs[nr_pci_devs];
+    pdev->bdf = bdf;
+    pdev->vendor_id = id & 0xffff;
+    pdev->device_id = id >> 16;
+    pdev->header_type = header_type;
+
+    if (pdev->header_type == PCI_HEADER_TYPE_NORMAL) {
+        /* STATUS shares the dword and is write-1-to-clear: write 0s */
+        cmd = pci_config_readl(bdf, PCI_COMMAND) & 0xffff;
+        pci_config_writel(bdf, PCI_COMMAND,
+                          cmd & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+        for (num = 0; num < PCI_BAR_NUM; )
+            num = pci_probe_bar(pdev, num);
+        pci_config_writel(bdf, PCI_COMMAND, cmd);
+    }
+
+    key = pci_hash_key(pdev->vendor_id, pdev->device_id);
+    pdev->hash_next = pci_hash[key];
+    pci_hash[key] = ++nr_pci_devs;
+}
+
+static void pci_scan_bus(int bus)
+{
+    pcidevaddr_t bdf;
+    uint32_t id, hdr;
+    int dev, fn, nr_fns;
+
+    for (dev = 0; dev < 32; ++dev) {
+        nr_fns = 1;
+        for (fn = 0; fn < nr_fns; ++fn) {
+            bdf = bus << 8 | dev << 3 | fn;
+            id = pci_config_readl(bdf, PCI_VENDOR_ID);
+            if ((id & 0xffff) == 0xffff || (id & 0xffff) == 0)
+                continue;
+            hdr = pci_config_readl(bdf, PCI_CACHE_LINE_SIZE) >> 16;
+            if (fn == 0 && (hdr & 0x80))
+                nr_fns = 8;
+            pci_add_dev(bdf, id, hdr & 0x7f);
+            if ((hdr & 0x7f) == PCI_HEADER_TYPE_BRIDGE) {
+                int secondary = (pci_config_readl(bdf, PCI_PRIMARY_BUS)
+                                 >> 8) & 0xff;
+                if (secondary > bus)
+                    pci_scan_bus(secondary);
+            }
+        }
+    }
+}
+
+void pci_init(void)
+{
+    if (pci_initialized)
+        return;
+    pci_initialized = true;
+    pci_find_ecam();
+    pci_scan_bus(0);
+}
+
+int pci_dev_count(void)
+{
+    pci_init();
+    return nr_pci_devs;
+}
+
+struct pci_dev *pci_dev_at(int index)
+{
+    pci_init();
+    return index < nr_pci_devs ? &pci_devs[index] : NULL;
+}
+
+struct pci_dev *pci_get_dev(pcidevaddr_t dev)
+{
+    int i;
+
+    pci_init();
+    for (i = 0; i < nr_pci_devs; ++i)
+        if (pci_devs[i].bdf == dev)
+            return &pci_devs[i];
+    return NULL;
+}
+
+pcidevaddr_t pci_find_dev(uint16_t vendor_id, uint16_t device_id)
+{
+    struct pci_dev *pdev;
+    int i;
+
+    pci_init();
+    for (i = pci_hash[pci_hash_key(vendor_id, device_id)]; i;
+         i = pdev->hash_next) {
+        pdev = &pci_devs[i - 1];
+        if (pdev->vendor_id == vendor_id && pdev->device_id == device_id)
+            return pdev->bdf;
     }
     return PCIDEVADDR_INVALID;
 }
 
+static struct pci_bar *pci_get_bar(pcidevaddr_t dev, int bar_num)
+{
+    struct pci_dev *pdev = pci_get_dev(dev);
+
+    if (!pdev || bar_num < 0 || bar_num >= PCI_BAR_NUM)
+        return NULL;
+    return &pdev->bar[bar_num];
+}
+
 unsigned long pci_bar_addr(pcidevaddr_t dev, int bar_num)
 {
-    uint32_t bar = pci_config_read(dev, PCI_BASE_ADDRESS_0 + bar_num * 4);
-    if (bar & PCI_BASE_ADDRESS_SPACE_IO) {
-        return bar & PCI_BASE_ADDRESS_IO_MASK;
-    } else {
-        return bar & PCI_BASE_ADDRESS_MEM_MASK;
-    }
+    struct pci_bar *bar = pci_get_bar(dev, bar_num);
+    return bar ? bar->addr : 0;
+}
+
+uint64_t pci_bar_size(pcidevaddr_t dev, int bar_num)
+{
+    struct pci_bar *bar = pci_get_bar(dev, bar_num);
+    return bar ? bar->size : 0;
 }
 
 bool pci_bar_is_memory(pcidevaddr_t dev, int bar_num)
 {
-    uint32_t bar = pci_config_read(dev, PCI_BASE_ADDRESS_0 + bar_num * 4);
-    return !(bar & PCI_BASE_ADDRESS_SPACE_IO);
+    struct pci_bar *bar = pci_get_bar(dev, bar_num);
+    return bar && !bar->io;
 }
 
 bool pci_bar_is_valid(pcidevaddr_t dev, int bar_num)
 {
-    uint32_t bar = pci_config_read(dev, PCI_BASE_ADDRESS_0 + bar_num * 4);
-    return bar;
+    struct pci_bar *bar = pci_get_bar(dev, bar_num);
+    return bar && bar->size;
+}
+
+bool pci_bar_is64(pcidevaddr_t dev, int bar_num)
+{
+    struct pci_bar *bar = pci_get_bar(dev, bar_num);
+    return bar && bar->is64;
 }
@@ -4,13 +4,53 @@
 #include <inttypes.h>
 #include "libcflat.h"
 
+/* bus << 8 | device << 3 | function */
 typedef uint16_t pcidevaddr_t;
 enum {
     PCIDEVADDR_INVALID = 0x0
 };
+
+#define PCI_MAX_DEVS    256
+#define PCI_BAR_NUM     6
+
+struct pci_bar {
+    uint64_t addr;
+    uint64_t size;
+    bool io;
+    bool is64;          /* set on the lower half of a 64-bit BAR */
+};
+
+struct pci_dev {
+    pcidevaddr_t bdf;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t header_type;
+    struct pci_bar bar[PCI_BAR_NUM];
+    int hash_next;
+};
+
+/*
+ * The bus hierarchy is enumerated once, on first use, into a device
+ * table; lookups after that cost no config cycles.  Config space is
+ * accessed through the ECAM window from the ACPI MCFG table when there is
+ * one (q35), and through the 0xcf8/0xcfc ports otherwise.
+ */
+void pci_init(void);
+int pci_dev_count(void);
+struct pci_dev *pci_dev_at(int index);
+struct pci_dev *pci_get_dev(pcidevaddr_t dev);
+
+bool pci_ecam_enabled(void);
+uint32_t pci_config_readl(pcidevaddr_t dev, uint16_t reg);
+void pci_config_writel(pcidevaddr_t dev, uint16_t reg, uint32_t val);
+uint32_t pci_config_readl_pio(pcidevaddr_t dev, uint8_t reg);
+uint32_t pci_config_readl_ecam(pcidevaddr_t dev, uint16_t reg);
+
 pcidevaddr_t pci_find_dev(uint16_t vendor_id, uint16_t device_id);
 unsigned long pci_bar_addr(pcidevaddr_t dev, int bar_num);
+uint64_t pci_bar_size(pcidevaddr_t dev, int bar_num);
 bool pci_bar_is_memory(pcidevaddr_t dev, int bar_num);
 bool pci_bar_is_valid(pcidevaddr_t dev, int bar_num);
+bool pci_bar_is64(pcidevaddr_t dev, int bar_num);
 
 #endif
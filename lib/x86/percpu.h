@@ -0,0 +1,46 @@
+#ifndef __PERCPU_H
+#define __PERCPU_H
+
+/*
+ * Per-cpu variables.  The linker collects them into a template that
+ * cstart copies into one area per cpu, each starting on its own cache
+ * line, and points GS at it.  The first bytes of every area belong to
+ * the runtime: smp_id() at %gs:0, exception info at %gs:4 and the area's
+ * own address at %gs:8.
+ *
+ *	DEFINE_PER_CPU(unsigned long, hits);
+ *
+ *	this_cpu_ptr(&hits)		this cpu's copy
+ *	per_cpu_ptr(&hits, cpu)		another cpu's copy, after smp_init()
+ */
+
+#define PERCPU_SELF_OFFSET	8
+
+#define DEFINE_PER_CPU(type, name) \
+	__attribute__((section(".data.percpu"))) __typeof__(type) name
+#define DECLARE_PER_CPU(type, name) \
+	extern __attribute__((section(".data.percpu"))) __typeof__(type) name
+
+extern char __per_cpu_start[];
+
+static inline char *this_cpu_area(void)
+{
+	char *area;
+
+	asm ("mov %%gs:%c1, %0" : "=r"(area) : "i"(PERCPU_SELF_OFFSET));
+	return area;
+}
+
+char *per_cpu_area(int cpu);
+
+#define __per_cpu_reloc(ptr, area) \
+	((__typeof__(ptr))((char *)(ptr) - __per_cpu_start + (area)))
+
+#define this_cpu_ptr(ptr)	__per_cpu_reloc(ptr, this_cpu_area())
+#define per_cpu_ptr(ptr, cpu)	__per_cpu_reloc(ptr, per_cpu_area(cpu))
+
+#define this_cpu_read(var)	(*(volatile __typeof__(var) *)this_cpu_ptr(&(var)))
+#define this_cpu_write(var, val) \
+	(*(volatile __typeof__(var) *)this_cpu_ptr(&(var)) = (val))
+
+#endif
@@ -324,6 +324,13 @@ static inline unsigned long long rdtsc()
 	return r;
 }
 
+/* rdtsc that does not start before earlier loads and stores are done */
+static inline u64 rdtsc_ordered(void)
+{
+	asm volatile("mfence; lfence" : : : "memory");
+	return rdtsc();
+}
+
 static inline void wrtsc(u64 tsc)
 {
 	unsigned a = tsc, d = tsc >> 32;
@@ -4,6 +4,9 @@
 #include "apic.h"
 #include "fwcfg.h"
 #include "desc.h"
+#include "processor.h"
+#include "atomic.h"
+#include "percpu.h"
 
 #define IPI_VECTOR 0x20
 
@@ -15,6 +18,7 @@ static void *volatile ipi_data;
 static volatile int ipi_done;
 static volatile bool ipi_wait;
 static int _cpu_count;
+static char *percpu_areas[256];
 
 static __attribute__((used)) void ipi()
 {
@@ -23,12 +27,12 @@ static __attribute__((used)) void ipi()
     bool wait = ipi_wait;
 
     if (!wait) {
-	ipi_done = 1;
+	smp_store_release(&ipi_done, 1);
 	apic_write(APIC_EOI, 0);
     }
     function(data);
     if (wait) {
-	ipi_done = 1;
+	smp_store_release(&ipi_done, 1);
 	apic_write(APIC_EOI, 0);
     }
 }
@@ -45,18 +49,44 @@ asm (
 
 void spin_lock(struct spinlock *lock)
 {
-    int v = 1;
+    unsigned ticket = __sync_fetch_and_add(&lock->next, 1);
 
-    do {
-	asm volatile ("xchg %1, %0" : "+m"(lock->v), "+r"(v));
-    } while (v);
+    while (lock->owner != ticket)
+	pause();
     asm volatile ("" : : : "memory");
 }
 
 void spin_unlock(struct spinlock *lock)
 {
     asm volatile ("" : : : "memory");
-    lock->v = 0;
+    lock->owner = lock->owner + 1;
+}
+
+void mcs_lock(struct mcs_lock *lock, struct mcs_node *node)
+{
+    struct mcs_node *prev;
+
+    node->next = NULL;
+    node->locked = 0;
+    prev = __sync_lock_test_and_set(&lock->tail, node);
+    if (prev) {
+	prev->next = node;
+	while (!node->locked)
+	    pause();
+    }
+    asm volatile ("" : : : "memory");
+}
+
+void mcs_unlock(struct mcs_lock *lock, struct mcs_node *node)
+{
+    asm volatile ("" : : : "memory");
+    if (!node->next) {
+	if (__sync_bool_compare_and_swap(&lock->tail, node, NULL))
+	    return;
+	while (!node->next)
+	    pause();
+    }
+    node->next->locked = 1;
 }
 
 int cpu_count(void)
@@ -75,6 +105,12 @@ int smp_id(void)
 static void setup_smp_id(void *data)
 {
     asm ("mov %0, %%gs:0" : : "r"(apic_id()) : "memory");
+    percpu_areas[smp_id()] = this_cpu_area();
+}
+
+char *per_cpu_area(int cpu)
+{
+    return percpu_areas[cpu];
 }
 
 static void __on_cpu(int cpu, void (*function)(void *data), void *data,
@@ -91,8 +127,8 @@ static void __on_cpu(int cpu, void (*function)(void *data), void *data,
 	apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL | APIC_DM_FIXED
                        | IPI_VECTOR,
                        cpu);
-	while (!ipi_done)
-	    ;
+	while (!smp_load_acquire(&ipi_done))
+	    pause();
     }
     spin_unlock(&ipi_lock);
 }
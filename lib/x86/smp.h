@@ -5,8 +5,27 @@
 #define rmb()	asm volatile("lfence":::"memory")
 #define wmb()	asm volatile("sfence" ::: "memory")
 
+/*
+ * Ticket lock: waiters are served in order and only read the owner field
+ * while they wait.  All-zero is unlocked, so static locks need no init.
+ */
 struct spinlock {
-    int v;
+    volatile unsigned next;
+    volatile unsigned owner;
+};
+
+/*
+ * MCS queue lock: each waiter spins on the locked flag of its own node,
+ * which the previous holder sets when handing the lock over.  A cpu must
+ * not reuse a node until it has released the lock taken with it.
+ */
+struct mcs_node {
+    struct mcs_node *volatile next;
+    volatile int locked;
+} __attribute__((aligned(64)));
+
+struct mcs_lock {
+    struct mcs_node *volatile tail;
 };
 
 void smp_init(void);
@@ -17,5 +36,7 @@ void on_cpu(int cpu, void (*function)(void *data), void *data);
 void on_cpu_async(int cpu, void (*function)(void *data), void *data);
 void spin_lock(struct spinlock *lock);
 void spin_unlock(struct spinlock *lock);
+void mcs_lock(struct mcs_lock *lock, struct mcs_node *node);
+void mcs_unlock(struct mcs_lock *lock, struct mcs_node *node);
 
 #endif
@@ -0,0 +1,25 @@
+#include "libcflat.h"
+#include "processor.h"
+#include "io.h"
+#include "tsc.h"
+
+#define PM_TIMER_PORT	0xb008
+#define PM_TIMER_HZ	3579545
+
+/* Count TSC cycles over 1/20 s of the 24-bit PM timer. */
+unsigned long long tsc_hz(void)
+{
+	static unsigned long long hz;
+	unsigned start, ticks;
+	unsigned long long t;
+
+	if (hz)
+		return hz;
+	start = inl(PM_TIMER_PORT);
+	t = rdtsc();
+	do {
+		ticks = (inl(PM_TIMER_PORT) - start) & 0xffffff;
+	} while (ticks < PM_TIMER_HZ / 20);
+	hz = (rdtsc() - t) * PM_TIMER_HZ / ticks;
+	return hz;
+}
@@ -0,0 +1,7 @@
+#ifndef TSC_H
+#define TSC_H
+
+/* TSC frequency, calibrated against the ACPI PM timer on first use. */
+unsigned long long tsc_hz(void);
+
+#endif
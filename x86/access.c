@@ -2,8 +2,8 @@
 #include "libcflat.h"
 #include "desc.h"
 #include "processor.h"
-
-#define smp_id() 0
+#include "smp.h"
+#include "atomic.h"
 
 #define true 1
 #define false 0
@@ -14,9 +14,10 @@ typedef unsigned long pt_element_t;
 
 #define PAGE_SIZE ((pt_element_t)4096)
 #define PAGE_MASK (~(PAGE_SIZE-1))
+#define LARGE_PAGE_SIZE (512 * PAGE_SIZE)
 
 #define PT_BASE_ADDR_MASK ((pt_element_t)((((pt_element_t)1 << 40) - 1) & PAGE_MASK))
-#define PT_PSE_BASE_ADDR_MASK (PT_BASE_ADDR_MASK & ~(1ull << 21))
+#define PT_PSE_BASE_ADDR_MASK (PT_BASE_ADDR_MASK & ~(LARGE_PAGE_SIZE - 1))
 
 #define PT_PRESENT_MASK    ((pt_element_t)1 << 0)
 #define PT_WRITABLE_MASK   ((pt_element_t)1 << 1)
@@ -41,6 +42,10 @@ typedef unsigned long pt_element_t;
 #define PT_INDEX(address, level)       \
        ((address) >> (12 + ((level)-1) * 9)) & 511
 
+/* vector 0x20 is taken by the smp IPI */
+#define AC_KERNEL_ENTRY_VECTOR 0x21
+#define AC_MAX_SHARDS 64
+
 /*
  * page table access check tests
  */
@@ -108,12 +113,48 @@ static inline void *va(pt_element_t phys)
     return (void *)phys;
 }
 
+/*
+ * Page table pages are cached per level, keyed by the address range they
+ * map, so tests on the same address reuse them and only rewrite entries
+ * whose contents change.
+ */
+typedef struct {
+    unsigned long key;
+    pt_element_t page;
+} ac_pt_cache_t;
+
 typedef struct {
     pt_element_t pt_pool;
     unsigned pt_pool_size;
     unsigned pt_pool_current;
+    pt_element_t *ptl2;
+    ac_pt_cache_t pt_cache[5];
 } ac_pool_t;
 
+typedef struct {
+    unsigned long pte_writes;
+    unsigned long invlpgs;
+} ac_stats_t;
+
+static ac_stats_t ac_stats[AC_MAX_SHARDS];
+
+/*
+ * The flag combinations are dealt out round-robin to one shard per cpu.
+ * Every shard has its own page table pool and, except for shard 0, its
+ * own copy of the boot page tables, so the ptl2 user bit games played
+ * for SMEP don't affect the other cpus.
+ */
+typedef struct {
+    int id;
+    int nr_shards;
+    ac_pool_t pool;
+    int tests;
+    int successes;
+} ac_shard_t;
+
+static ac_shard_t ac_shards[AC_MAX_SHARDS];
+static atomic_t ac_shards_done;
+
 typedef struct {
     unsigned flags[NR_AC_FLAGS];
     void *virt;
@@ -174,17 +215,51 @@ void set_efer_nx(int nx)
     wrmsr(MSR_EFER, efer);
 }
 
-static void ac_env_int(ac_pool_t *pool)
+static void ac_env_int(void)
 {
     setup_idt();
 
     extern char page_fault, kernel_entry;
     set_idt_entry(14, &page_fault, 0);
-    set_idt_entry(0x20, &kernel_entry, 3);
+    set_idt_entry(AC_KERNEL_ENTRY_VECTOR, &kernel_entry, 3);
+}
+
+static void ac_pool_init(ac_pool_t *pool, int shard, int nr_shards)
+{
+    extern u64 ptl2[];
+    pt_element_t start = 33 * 1024 * 1024;
+    pt_element_t size = ((120 * 1024 * 1024 - start) / nr_shards) & PAGE_MASK;
 
-    pool->pt_pool = 33 * 1024 * 1024;
-    pool->pt_pool_size = 120 * 1024 * 1024 - pool->pt_pool;
+    pool->pt_pool = start + shard * size;
+    pool->pt_pool_size = size;
     pool->pt_pool_current = 0;
+    pool->ptl2 = ptl2;
+    memset(pool->pt_cache, 0, sizeof(pool->pt_cache));
+}
+
+/*
+ * Give the calling cpu a private copy of the top three levels of the
+ * boot page tables, carved from the start of its pool.
+ */
+static void ac_pool_clone_root(ac_pool_t *pool)
+{
+    pt_element_t *l4 = va(pool->pt_pool);
+    pt_element_t *l3 = l4 + 512;
+    pt_element_t *l2 = l3 + 512;
+    pt_element_t *cur_l4 = va(read_cr3() & PT_BASE_ADDR_MASK);
+    pt_element_t *cur_l3 = va(cur_l4[0] & PT_BASE_ADDR_MASK);
+
+    memcpy(l4, cur_l4, PAGE_SIZE);
+    l4[0] = (pt_element_t)l3 | (cur_l4[0] & ~PT_BASE_ADDR_MASK);
+    memcpy(l3, cur_l3, PAGE_SIZE);
+    for (int i = 0; i < 4; ++i)
+	l3[i] = (pt_element_t)(l2 + 512 * i) | (cur_l3[i] & ~PT_BASE_ADDR_MASK);
+    memcpy(l2, pool->ptl2, 4 * PAGE_SIZE);
+
+    pool->ptl2 = l2;
+    pool->pt_pool += 6 * PAGE_SIZE;
+    pool->pt_pool_size -= 6 * PAGE_SIZE;
+    write_cr3((pt_element_t)l4);
 }
 
 void ac_test_init(ac_test_t *at, void *virt)
@@ -255,13 +330,39 @@ _Bool ac_test_enough_room(ac_pool_t *pool)
 void ac_test_reset_pt_pool(ac_pool_t *pool)
 {
     pool->pt_pool_current = 0;
+    memset(pool->pt_cache, 0, sizeof(pool->pt_cache));
+}
+
+/* Page table page that the level @level entry for @virt points to. */
+static pt_element_t ac_test_get_pt(ac_pool_t *pool, int level, void *virt)
+{
+    ac_pt_cache_t *c = &pool->pt_cache[level];
+    unsigned long key = (unsigned long)virt >> (12 + (level - 1) * 9);
+
+    if (!c->page || c->key != key) {
+	c->page = ac_test_alloc_pt(pool);
+	c->key = key;
+    }
+    return c->page;
+}
+
+static void ac_write_pte(pt_element_t *ptep, pt_element_t pte)
+{
+    *ptep = pte;
+    ++ac_stats[smp_id() % AC_MAX_SHARDS].pte_writes;
+}
+
+static void ac_invlpg(void *virt)
+{
+    invlpg(virt);
+    ++ac_stats[smp_id() % AC_MAX_SHARDS].invlpgs;
 }
 
 void ac_set_expected_status(ac_test_t *at)
 {
     int pde_valid, pte_valid;
 
-    invlpg(at->virt);
+    ac_invlpg(at->virt);
 
     if (at->ptep)
 	at->expected_pte = *at->ptep;
@@ -383,15 +484,18 @@ void __ac_setup_specific_pages(ac_test_t *at, ac_pool_t *pool, u64 pd_page,
 	pt_element_t *vroot = va(root & PT_BASE_ADDR_MASK);
 	unsigned index = PT_INDEX((unsigned long)at->virt, i);
 	pt_element_t pte = 0;
+	pt_element_t ignore = 0;
 	switch (i) {
 	case 4:
 	case 3:
-	    pte = pd_page ? pd_page : ac_test_alloc_pt(pool);
+	    pte = pd_page ? pd_page : ac_test_get_pt(pool, i, at->virt);
 	    pte |= PT_PRESENT_MASK | PT_WRITABLE_MASK | PT_USER_MASK;
+	    /* nobody checks accessed bits above the pde */
+	    ignore = PT_ACCESSED_MASK;
 	    break;
 	case 2:
 	    if (!at->flags[AC_PDE_PSE])
-		pte = pt_page ? pt_page : ac_test_alloc_pt(pool);
+		pte = pt_page ? pt_page : ac_test_get_pt(pool, i, at->virt);
 	    else {
 		pte = at->phys & PT_PSE_BASE_ADDR_MASK;
 		pte |= PT_PSE_MASK;
@@ -433,7 +537,8 @@ void __ac_setup_specific_pages(ac_test_t *at, ac_pool_t *pool, u64 pd_page,
 	    at->ptep = &vroot[index];
 	    break;
 	}
-	vroot[index] = pte;
+	if ((vroot[index] ^ pte) & ~ignore)
+	    ac_write_pte(&vroot[index], pte);
 	root = vroot[index];
     }
     ac_set_expected_status(at);
@@ -502,18 +607,20 @@ static int pt_match(pt_element_t pte1, pt_element_t pte2, pt_element_t ignore)
 
 int ac_test_do_access(ac_test_t *at)
 {
-    static unsigned unique = 42;
+    static unsigned uniques[AC_MAX_SHARDS];
+    unsigned *unique = &uniques[smp_id() % AC_MAX_SHARDS];
     int fault = 0;
     unsigned e;
-    static unsigned char user_stack[4096];
+    static unsigned char user_stacks[AC_MAX_SHARDS][4096];
+    unsigned char *user_stack = user_stacks[smp_id() % AC_MAX_SHARDS];
     unsigned long rsp;
     _Bool success = true;
 
-    ++unique;
+    ++*unique;
 
     *((unsigned char *)at->phys) = 0xc3; /* ret */
 
-    unsigned r = unique;
+    unsigned r = 42 + *unique;
     set_cr0_wp(at->flags[AC_CPU_CR0_WP]);
     set_efer_nx(at->flags[AC_CPU_EFER_NX]);
     if (at->flags[AC_CPU_CR4_SMEP] && !(cpuid(7).b & (1 << 7))) {
@@ -569,8 +676,8 @@ int ac_test_do_access(ac_test_t *at)
 		    [fetch]"r"(at->flags[AC_ACCESS_FETCH]),
 		    [user_ds]"i"(USER_DS),
 		    [user_cs]"i"(USER_CS),
-		    [user_stack_top]"r"(user_stack + sizeof user_stack),
-		    [kernel_entry_vector]"i"(0x20)
+		    [user_stack_top]"r"(user_stack + sizeof user_stacks[0]),
+		    [kernel_entry_vector]"i"(AC_KERNEL_ENTRY_VECTOR)
 		  : "rsi");
 
     asm volatile (".section .text.pf \n\t"
@@ -608,7 +715,9 @@ done:
 
 static void ac_test_show(ac_test_t *at)
 {
-    char line[5000];
+    /* APs run on 4k stacks, too small for this */
+    static char lines[AC_MAX_SHARDS][5000];
+    char *line = lines[smp_id() % AC_MAX_SHARDS];
 
     *line = 0;
     strcat(line, "test");
@@ -773,7 +882,7 @@ static int check_smep_andnot_wp(ac_pool_t *pool)
 	at1.flags[AC_CPU_CR0_WP] = 0;
 	at1.flags[AC_ACCESS_WRITE] = 1;
 	ac_test_setup_pte(&at1, pool);
-	ptl2[2] -= 0x4;
+	ac_write_pte(&ptl2[2], ptl2[2] - 0x4);
 
 	/*
 	 * Here we write the ro user page when
@@ -793,7 +902,7 @@ static int check_smep_andnot_wp(ac_pool_t *pool)
 
 clean_up:
 	set_cr4_smep(0);
-	ptl2[2] += 0x4;
+	ac_write_pte(&ptl2[2], ptl2[2] + 0x4);
 
 	if (!err_prepare_andnot_wp)
 		goto err;
@@ -828,38 +937,94 @@ const ac_test_fn ac_test_cases[] =
 	check_smep_andnot_wp
 };
 
-int ac_test_run(void)
+static void ac_shard_run(void *data)
 {
+    ac_shard_t *shard = data;
+    pt_element_t *ptl2;
+    unsigned long cr3 = read_cr3();
+    unsigned long n = 0;
     ac_test_t at;
-    ac_pool_t pool;
-    int i, tests, successes;
-    extern u64 ptl2[];
 
-    printf("run\n");
-    tests = successes = 0;
-    ac_env_int(&pool);
-    ac_test_init(&at, (void *)(0x123400000000 + 16 * smp_id()));
+    if (shard->id)
+	ac_pool_clone_root(&shard->pool);
+    ptl2 = shard->pool.ptl2;
+
+    /*
+     * Each shard gets its own data page, at the same offset from 32MB
+     * as its address is from a 2MB boundary: large pages map the 2MB
+     * frame at 32MB and reach the page through the virtual offset.
+     */
+    ac_test_init(&at, (void *)(0x123400000000 + ((u64)shard->id << 30)
+			       + shard->id * PAGE_SIZE));
+    at.phys += shard->id * PAGE_SIZE;
     do {
+	if (n++ % shard->nr_shards != shard->id)
+	    continue;
+
 	if (at.flags[AC_CPU_CR4_SMEP] && (ptl2[2] & 0x4))
-		ptl2[2] -= 0x4;
+		ac_write_pte(&ptl2[2], ptl2[2] - 0x4);
 	if (!at.flags[AC_CPU_CR4_SMEP] && !(ptl2[2] & 0x4)) {
 		set_cr4_smep(0);
-		ptl2[2] += 0x4;
+		ac_write_pte(&ptl2[2], ptl2[2] + 0x4);
 	}
 
-	++tests;
-	successes += ac_test_exec(&at, &pool);
+	++shard->tests;
+	shard->successes += ac_test_exec(&at, &shard->pool);
     } while (ac_test_bump(&at));
 
     set_cr4_smep(0);
-    ptl2[2] += 0x4;
+    if (!(ptl2[2] & 0x4))
+	ac_write_pte(&ptl2[2], ptl2[2] + 0x4);
+
+    if (shard->id) {
+	write_cr3(cr3);
+	atomic_inc(&ac_shards_done);
+    }
+}
+
+int ac_test_run(void)
+{
+    int i, tests, successes, nr_shards;
+    unsigned long pte_writes = 0, invlpgs = 0;
+
+    printf("run\n");
+    tests = successes = 0;
+    ac_env_int();
+
+    nr_shards = cpu_count();
+    if (nr_shards > AC_MAX_SHARDS)
+	nr_shards = AC_MAX_SHARDS;
+    atomic_set(&ac_shards_done, 0);
+    for (i = 0; i < nr_shards; i++) {
+	ac_shards[i].id = i;
+	ac_shards[i].nr_shards = nr_shards;
+	ac_pool_init(&ac_shards[i].pool, i, nr_shards);
+	ac_shards[i].tests = ac_shards[i].successes = 0;
+    }
+    for (i = 1; i < nr_shards; i++)
+	on_cpu_async(i, ac_shard_run, &ac_shards[i]);
+    ac_shard_run(&ac_shards[0]);
+    while (atomic_read(&ac_shards_done) != nr_shards - 1)
+	pause();
+
+    for (i = 0; i < nr_shards; i++) {
+	tests += ac_shards[i].tests;
+	successes += ac_shards[i].successes;
+    }
 
     for (i = 0; i < ARRAY_SIZE(ac_test_cases); i++) {
 	++tests;
-	successes += ac_test_cases[i](&pool);
+	successes += ac_test_cases[i](&ac_shards[0].pool);
+    }
+
+    for (i = 0; i < AC_MAX_SHARDS; i++) {
+	pte_writes += ac_stats[i].pte_writes;
+	invlpgs += ac_stats[i].invlpgs;
     }
 
-    printf("\n%d tests, %d failures\n", tests, tests - successes);
+    printf("\n%d tests, %d failures (%d shards)\n", tests,
+           tests - successes, nr_shards);
+    printf("%ld pte writes, %ld invlpgs\n", pte_writes, invlpgs);
 
     return successes == tests;
 }
@@ -869,6 +1034,8 @@ int main()
     int r;
 
     printf("starting test\n\n");
+    if (verbose)
+	console_buffer(true);
     r = ac_test_run();
     return r ? 0 : 1;
 }
@@ -0,0 +1,162 @@
+/*
+ * Local APIC register access cost, xAPIC MMIO vs x2APIC MSR
+ *
+ * Times the common register reads and writes through apic_read(),
+ * apic_write() and apic_icr_write() in xAPIC mode and, if the CPU has it,
+ * in x2APIC mode.  EOI is additionally timed from inside interrupt
+ * handlers, with one interrupt in service and with more self-IPIs still
+ * pending in the IRR.  Results are cycles per access.
+ */
+
+#include "libcflat.h"
+#include "processor.h"
+#include "apic.h"
+#include "isr.h"
+#include "desc.h"
+#include "vm.h"
+
+#define GOAL (1ull << 28)
+#define NOBODY_APIC_ID		0xf0	/* ICR destination without a cpu */
+#define EOI_VECTOR_BASE		0x50
+#define MAX_PENDING		16
+#define EOI_ROUNDS		(1 << 14)
+
+static void id_read(void)
+{
+	apic_read(APIC_ID);
+}
+
+static void tpr_read(void)
+{
+	apic_read(APIC_TASKPRI);
+}
+
+static void tpr_write(void)
+{
+	apic_write(APIC_TASKPRI, 0);
+}
+
+static void eoi_idle(void)
+{
+	apic_write(APIC_EOI, 0);
+}
+
+static void icr_write(void)
+{
+	apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL | APIC_DM_FIXED
+		       | EOI_VECTOR_BASE, NOBODY_APIC_ID);
+}
+
+static void tmcct_read(void)
+{
+	apic_read(APIC_TMCCT);
+}
+
+static void tmict_write(void)
+{
+	apic_write(APIC_TMICT, 0xffffffff);
+}
+
+static struct access {
+	const char *name;
+	void (*func)(void);
+} accesses[] = {
+	{ "id-read", id_read },
+	{ "tpr-read", tpr_read },
+	{ "tpr-write", tpr_write },
+	{ "eoi-idle", eoi_idle },
+	{ "icr-write", icr_write },
+	{ "tmcct-read", tmcct_read },
+	{ "tmict-write", tmict_write },
+	{ NULL },
+};
+
+static void bench(const char *mode, const char *name, void (*func)(void))
+{
+	unsigned long long t1, t2;
+	int iterations = 32, i;
+
+	do {
+		iterations *= 2;
+		t1 = rdtsc();
+		for (i = 0; i < iterations; ++i)
+			func();
+		t2 = rdtsc();
+	} while ((t2 - t1) < GOAL);
+	printf("%-6s %-16s %d\n", mode, name, (int)((t2 - t1) / iterations));
+}
+
+static unsigned long long eoi_cycles;
+static unsigned eoi_count;
+
+static void eoi_isr(isr_regs_t *regs)
+{
+	unsigned long long t = rdtsc();
+
+	apic_write(APIC_EOI, 0);
+	eoi_cycles += rdtsc() - t;
+	++eoi_count;
+}
+
+/*
+ * Queue npending self-IPIs with interrupts off, then let them in.  Each
+ * handler's EOI sees the remaining ones still pending in the IRR.
+ */
+static void bench_eoi_loaded(const char *mode, int npending)
+{
+	char name[32];
+	int i, v;
+
+	eoi_cycles = 0;
+	eoi_count = 0;
+	for (i = 0; i < EOI_ROUNDS; ++i) {
+		for (v = 0; v < npending; ++v)
+			apic_icr_write(APIC_DEST_SELF | APIC_DEST_PHYSICAL
+				       | APIC_DM_FIXED
+				       | (EOI_VECTOR_BASE + v), 0);
+		irq_enable();
+		while (eoi_count < (unsigned)(i + 1) * npending)
+			pause();
+		irq_disable();
+	}
+	snprintf(name, sizeof(name), "eoi-pending-%d", npending);
+	printf("%-6s %-16s %d\n", mode, name, (int)(eoi_cycles / eoi_count));
+}
+
+static void run_all(void)
+{
+	const char *mode = x2apic_enabled() ? "x2apic" : "xapic";
+	struct access *a;
+	int n;
+
+	apic_write(APIC_LVTT, APIC_LVT_MASKED);
+	apic_write(APIC_TMICT, 0xffffffff);
+	for (a = accesses; a->name; ++a)
+		bench(mode, a->name, a->func);
+	apic_write(APIC_TMICT, 0);
+
+	for (n = 1; n <= MAX_PENDING; n *= 4)
+		bench_eoi_loaded(mode, n);
+}
+
+int main(int ac, char **av)
+{
+	int v;
+
+	setup_vm();
+	setup_idt();
+	mask_pic_interrupts();
+	for (v = 0; v < MAX_PENDING; ++v)
+		handle_irq(EOI_VECTOR_BASE + v, eoi_isr);
+
+	if (x2apic_enabled())
+		reset_apic();
+	run_all();
+
+	if (enable_x2apic())
+		run_all();
+	else
+		printf("x2apic (skipped, not supported)\n");
+
+	return 0;
+}
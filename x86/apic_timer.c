@@ -0,0 +1,263 @@
+/*
+ * APIC timer accuracy
+ *
+ * Every CPU arms its local APIC timer over and over and records, for each
+ * interrupt, how many TSC cycles after the programmed expiry it arrived:
+ *
+ *   tsc-deadline	IA32_TSC_DEADLINE = now + delta
+ *   oneshot		TMICT = delta converted to APIC timer ticks
+ *   periodic		TMICT set once; skew of each period against delta
+ *
+ * While waiting the CPU either sits in hlt ("idle") or spins with
+ * interrupts enabled ("busy").  For every mode, variant and CPU the skews
+ * are summarized as min/avg/max plus a log2 histogram; interrupts that
+ * arrive before the expiry are counted as "early".
+ *
+ * Arguments: delta=<cycles> (may be repeated) count=<timers per cpu>
+ */
+
+#include "libcflat.h"
+#include "processor.h"
+#include "smp.h"
+#include "apic.h"
+#include "isr.h"
+#include "atomic.h"
+#include "tsc.h"
+#include "vm.h"
+
+#define MSR_IA32_TSCDEADLINE	0x6e0
+#define APIC_LVT_TIMER_ONESHOT	(0 << 17)
+#define APIC_LVT_TIMER_TSCDEADLINE (2 << 17)
+
+#define TIMER_VECTOR		0xee
+#define MAX_CPUS		64
+#define MAX_DELTAS		8
+#define NR_BUCKETS		40
+
+enum { MODE_TSC_DEADLINE, MODE_ONESHOT, MODE_PERIODIC, NR_MODES };
+
+static const char *mode_names[] = {
+	[MODE_TSC_DEADLINE] = "tsc-deadline",
+	[MODE_ONESHOT] = "oneshot",
+	[MODE_PERIODIC] = "periodic",
+};
+
+/* Per cpu, on its own cache lines: the ISR writes while others spin. */
+struct hist {
+	volatile u64 arrival;		/* TSC at the last interrupt */
+	volatile unsigned fired;
+	long long min, max, sum;
+	unsigned n, early;
+	unsigned bucket[NR_BUCKETS];	/* bucket k: skew in [2^(k-1), 2^k) */
+} __attribute__((aligned(64)));
+
+static struct hist hists[MAX_CPUS];
+
+static int nr_cpus;
+static int mode;
+static int idle;
+static unsigned long long delta;
+static unsigned long long deltas[MAX_DELTAS] = { 20000, 200000, 2000000 };
+static int nr_deltas = 3;
+static unsigned count = 1000;
+static u64 ticks_per_tsc;		/* APIC timer ticks per TSC cycle, 32.32 */
+static atomic_t nr_done;
+
+/* Let the APIC timer count down at divide-by-1 for 1/20 s of TSC. */
+static void calibrate_apic_timer(void)
+{
+	unsigned long long t0, t1, span = tsc_hz() / 20;
+	u32 c0, c1;
+
+	apic_write(APIC_LVTT, APIC_LVT_MASKED | TIMER_VECTOR);
+	apic_write(APIC_TDCR, APIC_TDR_DIV_1);
+	apic_write(APIC_TMICT, 0xffffffff);
+	t0 = rdtsc();
+	c0 = apic_read(APIC_TMCCT);
+	while (rdtsc() - t0 < span)
+		pause();
+	c1 = apic_read(APIC_TMCCT);
+	t1 = rdtsc();
+	apic_write(APIC_TMICT, 0);
+	ticks_per_tsc = ((u64)(c0 - c1) << 32) / (t1 - t0);
+}
+
+static void timer_isr(isr_regs_t *regs)
+{
+	struct hist *h = &hists[smp_id()];
+
+	h->arrival = rdtsc();
+	++h->fired;
+	apic_write(APIC_EOI, 0);
+}
+
+static void hist_add(struct hist *h, long long skew)
+{
+	int k = 0;
+
+	if (!h->n || skew < h->min)
+		h->min = skew;
+	if (!h->n || skew > h->max)
+		h->max = skew;
+	h->sum += skew;
+	++h->n;
+	if (skew < 0) {
+		++h->early;
+		return;
+	}
+	while (skew && k < NR_BUCKETS - 1) {
+		skew >>= 1;
+		++k;
+	}
+	++h->bucket[k];
+}
+
+/* Returns with interrupts disabled once the timer fired at least n times. */
+static void wait_fired(struct hist *h, unsigned n)
+{
+	if (idle) {
+		while (h->fired < n)
+			asm volatile("sti; hlt; cli");
+	} else {
+		irq_enable();
+		while (h->fired < n)
+			pause();
+		irq_disable();
+	}
+}
+
+static void timer_worker(void *junk)
+{
+	struct hist *h = &hists[smp_id()];
+	u32 ticks = (delta * ticks_per_tsc) >> 32;
+	u64 t, prev;
+	unsigned i;
+
+	if (!ticks)
+		ticks = 1;
+	memset(h, 0, sizeof(*h));
+	irq_disable();
+
+	switch (mode) {
+	case MODE_TSC_DEADLINE:
+		apic_write(APIC_LVTT, APIC_LVT_TIMER_TSCDEADLINE | TIMER_VECTOR);
+		for (i = 1; i <= count; ++i) {
+			t = rdtsc() + delta;
+			wrmsr(MSR_IA32_TSCDEADLINE, t);
+			wait_fired(h, i);
+			hist_add(h, h->arrival - t);
+		}
+		break;
+	case MODE_ONESHOT:
+		apic_write(APIC_LVTT, APIC_LVT_TIMER_ONESHOT | TIMER_VECTOR);
+		apic_write(APIC_TDCR, APIC_TDR_DIV_1);
+		for (i = 1; i <= count; ++i) {
+			t = rdtsc() + delta;
+			apic_write(APIC_TMICT, ticks);
+			wait_fired(h, i);
+			hist_add(h, h->arrival - t);
+		}
+		break;
+	case MODE_PERIODIC:
+		/* Periods are measured arrival to arrival, so a slightly
+		 * wrong calibration does not accumulate over the run. */
+		apic_write(APIC_LVTT, APIC_LVT_TIMER_PERIODIC | TIMER_VECTOR);
+		apic_write(APIC_TDCR, APIC_TDR_DIV_1);
+		prev = rdtsc();
+		apic_write(APIC_TMICT, ticks);
+		for (i = 1; i <= count; i = h->fired + 1) {
+			wait_fired(h, i);
+			t = h->arrival;
+			hist_add(h, (long long)(t - prev)
+				 - (long long)delta * (h->fired - i + 1));
+			prev = t;
+		}
+		apic_write(APIC_TMICT, 0);
+		break;
+	}
+
+	apic_write(APIC_LVTT, APIC_LVT_MASKED | TIMER_VECTOR);
+	if (mode == MODE_TSC_DEADLINE)
+		wrmsr(MSR_IA32_TSCDEADLINE, 0);
+	atomic_inc(&nr_done);
+}
+
+static void print_hist(int cpu)
+{
+	struct hist *h = &hists[cpu];
+	int k;
+
+	printf("%-12s %-4s delta %8lld cpu %2d: min %lld avg %lld max %lld\n",
+	       mode_names[mode], idle ? "idle" : "busy", delta, cpu,
+	       h->min, h->n ? h->sum / (long long)h->n : 0, h->max);
+	printf("    early %u", h->early);
+	for (k = 0; k < NR_BUCKETS; ++k)
+		if (h->bucket[k])
+			printf(" <%llu:%u", 1ull << k, h->bucket[k]);
+	printf("\n");
+}
+
+/* CPU 0 runs its part synchronously, so it is started last. */
+static void run(void)
+{
+	int cpu;
+
+	atomic_set(&nr_done, 0);
+	for (cpu = nr_cpus - 1; cpu >= 0; --cpu)
+		on_cpu_async(cpu, timer_worker, 0);
+	while (atomic_read(&nr_done) < nr_cpus)
+		pause();
+	for (cpu = 0; cpu < nr_cpus; ++cpu)
+		print_hist(cpu);
+}
+
+static void parse_args(int ac, char **av)
+{
+	int i, n = 0;
+
+	for (i = 0; i < ac; ++i) {
+		if (memcmp(av[i], "delta=", 6) == 0) {
+			if (n < MAX_DELTAS)
+				deltas[n++] = atol(av[i] + 6);
+		} else if (memcmp(av[i], "count=", 6) == 0) {
+			count = atol(av[i] + 6);
+		}
+	}
+	if (n)
+		nr_deltas = n;
+	if (count < 1)
+		count = 1;
+}
+
+int main(int ac, char **av)
+{
+	int d;
+
+	parse_args(ac - 1, av + 1);
+	smp_init();
+	setup_vm();
+
+	nr_cpus = cpu_count();
+	if (nr_cpus > MAX_CPUS)
+		nr_cpus = MAX_CPUS;
+
+	handle_irq(TIMER_VECTOR, timer_isr);
+	calibrate_apic_timer();
+	printf("tsc %lld kHz, apic timer %lld kHz\n", tsc_hz() / 1000,
+	       (tsc_hz() * ticks_per_tsc >> 32) / 1000);
+
+	for (mode = 0; mode < NR_MODES; ++mode) {
+		if (mode == MODE_TSC_DEADLINE && !(cpuid(1).c & (1 << 24))) {
+			printf("%s (skipped, not supported)\n",
+			       mode_names[mode]);
+			continue;
+		}
+		for (idle = 0; idle < 2; ++idle)
+			for (d = 0; d < nr_deltas; ++d) {
+				delta = deltas[d];
+				run();
+			}
+	}
+
+	return 0;
+}
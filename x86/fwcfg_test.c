@@ -0,0 +1,67 @@
+/*
+ * fw_cfg access through lib/x86/fwcfg.c
+ *
+ * Reads the fixed items and a file with fwcfg_read(), which goes through
+ * the DMA interface when the host has it, and compares the results with
+ * plain reads of the data port.  Also checks the file directory lookup.
+ */
+
+#include "libcflat.h"
+#include "fwcfg.h"
+#include "io.h"
+
+#define CMP_BYTES	256
+
+static u8 dma_buf[CMP_BYTES], pio_buf[CMP_BYTES];
+
+static void pio_read(unsigned index, void *buf, uint32_t len)
+{
+	u8 *p = buf;
+
+	outw(index, BIOS_CFG_IOPORT);
+	while (len--)
+		*p++ = inb(BIOS_CFG_IOPORT + 1);
+}
+
+static void compare_item(const char *name, unsigned index, uint32_t len)
+{
+	char msg[64];
+
+	memset(dma_buf, 0xaa, sizeof(dma_buf));
+	memset(pio_buf, 0x55, sizeof(pio_buf));
+	fwcfg_read(index, dma_buf, len);
+	pio_read(index, pio_buf, len);
+	snprintf(msg, sizeof(msg), "%s matches the data port", name);
+	report(msg, memcmp(dma_buf, pio_buf, len) == 0);
+}
+
+int main(int ac, char **av)
+{
+	uint32_t id = 0, size = 0;
+	unsigned sel;
+
+	fwcfg_read(FW_CFG_ID, &id, sizeof(id));
+	printf("fw_cfg id %x, %s\n", id,
+	       id & FW_CFG_VERSION_DMA ? "dma" : "no dma");
+
+	fwcfg_read(FW_CFG_SIGNATURE, dma_buf, 4);
+	report("signature", memcmp(dma_buf, "QEMU", 4) == 0);
+
+	compare_item("id", FW_CFG_ID, 4);
+	compare_item("ram size", FW_CFG_RAM_SIZE, 8);
+	compare_item("nb cpus", FW_CFG_NB_CPUS, 2);
+	compare_item("max cpus", FW_CFG_MAX_CPUS, 2);
+	pio_read(FW_CFG_NB_CPUS, pio_buf, 2);
+	report("cached nb cpus",
+	       fwcfg_get_u16(FW_CFG_NB_CPUS) == *(u16 *)pio_buf);
+
+	sel = fwcfg_find_file("etc/acpi/tables", &size);
+	report("find etc/acpi/tables", sel != FW_CFG_INVALID && size > 0);
+	if (sel != FW_CFG_INVALID)
+		compare_item("etc/acpi/tables", sel,
+			     size < CMP_BYTES ? size : CMP_BYTES);
+	report("missing file",
+	       fwcfg_find_file("etc/no-such-file", NULL) == FW_CFG_INVALID);
+
+	return report_summary();
+}
@@ -0,0 +1,168 @@
+/*
+ * Wakeup latency from hlt versus idle time
+ *
+ * CPU 1 sits in a safe_halt() loop ("sti; hlt") and announces each time it
+ * is about to halt.  CPU 0 waits for that, lets it stay idle for a given
+ * interval, stamps the TSC and sends a fixed IPI; the handler on CPU 1
+ * stamps it again on entry.  Host halt polling makes short idle intervals
+ * cheap to wake from; sweeping the interval shows where polling gives up
+ * (compare with halt_poll_ns).  A spinning target gives the floor.
+ *
+ * Arguments: interval=<us> (may be repeated) rounds=<wakeups per interval>
+ */
+
+#include "libcflat.h"
+#include "processor.h"
+#include "smp.h"
+#include "apic.h"
+#include "isr.h"
+#include "atomic.h"
+#include "vm.h"
+#include "tsc.h"
+
+#define WAKE_VECTOR		0x44
+#define TARGET			1
+#define MAX_INTERVALS		16
+#define MAX_ROUNDS		4096
+
+static unsigned long intervals_us[MAX_INTERVALS] = {
+	0, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000,
+};
+static int nr_intervals = 13;
+static int rounds = 200;
+
+static volatile u64 recv_tsc;
+static volatile unsigned received;
+static volatile unsigned idle_seq;
+static volatile bool stop;
+static atomic_t stopped;
+static unsigned long long samples[MAX_ROUNDS];
+
+static void wake_isr(isr_regs_t *regs)
+{
+	recv_tsc = rdtsc();
+	++received;
+	apic_write(APIC_EOI, 0);
+}
+
+static void halt_target(void *junk)
+{
+	irq_disable();
+	while (!stop) {
+		++idle_seq;
+		safe_halt();
+		irq_disable();
+	}
+	atomic_inc(&stopped);
+}
+
+static void spin_target(void *junk)
+{
+	irq_enable();
+	while (!stop) {
+		++idle_seq;
+		pause();
+	}
+	irq_disable();
+	atomic_inc(&stopped);
+}
+
+static void sort_samples(int n)
+{
+	unsigned long long v;
+	int i, j;
+
+	for (i = 1; i < n; ++i) {
+		v = samples[i];
+		for (j = i; j > 0 && samples[j - 1] > v; --j)
+			samples[j] = samples[j - 1];
+		samples[j] = v;
+	}
+}
+
+static void wake(void)
+{
+	apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL | APIC_DM_FIXED
+		       | WAKE_VECTOR, TARGET);
+}
+
+static void measure(bool halt, unsigned long us)
+{
+	unsigned long long idle = tsc_hz() * us / 1000000, t;
+	int i;
+
+	received = 0;
+	idle_seq = 0;
+	stop = false;
+	atomic_set(&stopped, 0);
+	on_cpu_async(TARGET, halt ? halt_target : spin_target, 0);
+
+	for (i = 0; i < rounds; ++i) {
+		/* the target bumps idle_seq right before each hlt */
+		while (idle_seq <= i)
+			pause();
+		t = rdtsc();
+		while (rdtsc() - t < idle)
+			pause();
+		t = rdtsc();
+		wake();
+		while (received == i)
+			pause();
+		samples[i] = recv_tsc - t;
+	}
+
+	stop = true;
+	wake();
+	while (atomic_read(&stopped) < 1)
+		pause();
+
+	sort_samples(rounds);
+	printf("%-4s idle %5ld us: min %lld p50 %lld p90 %lld p99 %lld"
+	       " max %lld cycles (p50 %lld ns)\n", halt ? "halt" : "spin", us,
+	       samples[0], samples[rounds / 2], samples[rounds * 9 / 10],
+	       samples[rounds * 99 / 100], samples[rounds - 1],
+	       samples[rounds / 2] * 1000000000ull / tsc_hz());
+}
+
+static void parse_args(int ac, char **av)
+{
+	int i, n = 0;
+
+	for (i = 0; i < ac; ++i) {
+		if (memcmp(av[i], "interval=", 9) == 0) {
+			if (n < MAX_INTERVALS)
+				intervals_us[n++] = atol(av[i] + 9);
+		} else if (memcmp(av[i], "rounds=", 7) == 0) {
+			rounds = atol(av[i] + 7);
+		}
+	}
+	if (n)
+		nr_intervals = n;
+	if (rounds < 1)
+		rounds = 1;
+	if (rounds > MAX_ROUNDS)
+		rounds = MAX_ROUNDS;
+}
+
+int main(int ac, char **av)
+{
+	int i;
+
+	parse_args(ac - 1, av + 1);
+	smp_init();
+	setup_vm();
+
+	if (cpu_count() < 2) {
+		printf("halt_wakeup needs at least 2 cpus\n");
+		return 1;
+	}
+
+	handle_irq(WAKE_VECTOR, wake_isr);
+	printf("tsc %lld kHz\n", tsc_hz() / 1000);
+
+	measure(false, 0);
+	for (i = 0; i < nr_intervals; ++i)
+		measure(true, intervals_us[i]);
+
+	return 0;
+}
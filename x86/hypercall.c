@@ -1,7 +1,26 @@
+/*
+ * KVM hypercall latency
+ *
+ * Issues the native hypercall instruction and the other vendor's one
+ * (which KVM patches in place on first use, so every timed call restores
+ * the original bytes to stay on the patching path), then the common KVM
+ * hypercalls.  PV send-IPI is timed for a growing number of destinations.
+ * Results are cycles per call.
+ */
+
 #include "libcflat.h"
+#include "processor.h"
+#include "smp.h"
+#include "apic.h"
+#include "isr.h"
+#include "desc.h"
+#include "atomic.h"
+#include "vm.h"
+#include "kvm_para.h"
 
-#define KVM_HYPERCALL_INTEL ".byte 0x0f,0x01,0xc1"
-#define KVM_HYPERCALL_AMD ".byte 0x0f,0x01,0xd9"
+#define GOAL (1ull << 28)
+#define IPI_BENCH_VECTOR	0x41
+#define IPI_BENCH_CALLS		(1 << 14)
 
 static inline long kvm_hypercall0_intel(unsigned int nr)
 {
@@ -21,11 +40,159 @@ static inline long kvm_hypercall0_amd(unsigned int nr)
 	return ret;
 }
 
+static bool intel;
+
+/* The other vendor's instruction followed by ret, rewritten before use. */
+static u8 patch_buf[16] __attribute__((aligned(16)));
+static const u8 intel_insn[] = { 0x0f, 0x01, 0xc1, 0xc3 };
+static const u8 amd_insn[] = { 0x0f, 0x01, 0xd9, 0xc3 };
+
+static void native_hypercall(void)
+{
+	if (intel)
+		kvm_hypercall0_intel(-1u);
+	else
+		kvm_hypercall0_amd(-1u);
+}
+
+static void patched_hypercall(void)
+{
+	long ret;
+
+	memcpy(patch_buf, intel ? amd_insn : intel_insn, sizeof(intel_insn));
+	asm volatile("call *%1" : "=a"(ret) : "r"(patch_buf), "a"(-1u)
+		     : "memory");
+}
+
+static void vapic_poll_irq(void)
+{
+	kvm_hypercall2(KVM_HC_VAPIC_POLL_IRQ, 0, 0);
+}
+
+static int kick_target;
+
+static void kick_cpu(void)
+{
+	kvm_hypercall2(KVM_HC_KICK_CPU, 0, kick_target);
+}
+
+/*
+ * With the fix_hypercall quirk disabled, KVM injects #UD instead of
+ * patching the other vendor's instruction.
+ */
+static bool cross_vendor_works(void)
+{
+	if (intel)
+		asm volatile(ASM_TRY("1f")
+			     KVM_HYPERCALL_AMD "\n\t"
+			     "1:" : : "a"(-1u) : "memory");
+	else
+		asm volatile(ASM_TRY("1f")
+			     KVM_HYPERCALL_INTEL "\n\t"
+			     "1:" : : "a"(-1u) : "memory");
+	return exception_vector() == 0;
+}
+
+static void bench(const char *name, void (*func)(void))
+{
+	unsigned long long t1, t2;
+	int iterations = 32, i;
+
+	do {
+		iterations *= 2;
+		t1 = rdtsc();
+		for (i = 0; i < iterations; ++i)
+			func();
+		t2 = rdtsc();
+	} while ((t2 - t1) < GOAL);
+	printf("%s %d\n", name, (int)((t2 - t1) / iterations));
+}
+
+static atomic_t ipis_received;
+
+static void ipi_handler(isr_regs_t *regs)
+{
+	atomic_inc(&ipis_received);
+	apic_write(APIC_EOI, 0);
+}
+
+/* PV IPI from cpu 0 to cpus 1..ndest, waiting for delivery between calls */
+static void bench_send_ipi(int ndest)
+{
+	unsigned long mask = ((1ul << ndest) - 1) << 1;
+	unsigned long long t, total = 0;
+	long ret;
+	int i;
+
+	atomic_set(&ipis_received, 0);
+	for (i = 0; i < IPI_BENCH_CALLS; ++i) {
+		t = rdtsc();
+		ret = kvm_hypercall4(KVM_HC_SEND_IPI, mask, 0, 0,
+				     APIC_DM_FIXED | IPI_BENCH_VECTOR);
+		total += rdtsc() - t;
+		if (ret != ndest) {
+			printf("send_ipi %d dests: returned %ld\n", ndest, ret);
+			return;
+		}
+		while (atomic_read(&ipis_received) < (i + 1) * ndest)
+			pause();
+	}
+	printf("send_ipi %d dests %d\n", ndest,
+	       (int)(total / IPI_BENCH_CALLS));
+}
+
 int main(int ac, char **av)
 {
-	kvm_hypercall0_intel(-1u);
-	printf("Hypercall via VMCALL: OK\n");
-	kvm_hypercall0_amd(-1u);
-	printf("Hypercall via VMMCALL: OK\n");
+	u32 features;
+	int max_dest, ndest;
+
+	smp_init();
+	setup_vm();
+	intel = cpuid(0).b == CPUID_VENDOR_INTEL;
+	features = kvm_features();
+
+	native_hypercall();
+	printf("Hypercall via %s: OK\n", intel ? "VMCALL" : "VMMCALL");
+	bench(intel ? "vmcall" : "vmmcall", native_hypercall);
+
+	if (cross_vendor_works()) {
+		printf("Hypercall via %s: OK\n", intel ? "VMMCALL" : "VMCALL");
+		bench(intel ? "vmmcall-patched" : "vmcall-patched",
+		      patched_hypercall);
+	} else {
+		printf("Hypercall via %s: #UD, patching disabled\n",
+		       intel ? "VMMCALL" : "VMCALL");
+	}
+
+	bench("vapic_poll_irq", vapic_poll_irq);
+
+	if (features & (1 << KVM_FEATURE_PV_UNHALT)) {
+		kick_target = cpu_count() > 1 ? 1 : 0;
+		bench("kick_cpu", kick_cpu);
+	} else {
+		printf("kick_cpu (skipped, no PV_UNHALT)\n");
+	}
+
+	if (!(features & (1 << KVM_FEATURE_PV_SEND_IPI))) {
+		printf("send_ipi (skipped, no PV_SEND_IPI)\n");
+		return 0;
+	}
+	if (cpu_count() < 2) {
+		printf("send_ipi (skipped, needs smp)\n");
+		return 0;
+	}
+
+	handle_irq(IPI_BENCH_VECTOR, ipi_handler);
+	irq_enable();
+	max_dest = cpu_count() - 1;
+	if (max_dest > sizeof(long) * 8 - 1)
+		max_dest = sizeof(long) * 8 - 1;
+	for (ndest = 1; ; ndest *= 2) {
+		if (ndest > max_dest)
+			ndest = max_dest;
+		bench_send_ipi(ndest);
+		if (ndest == max_dest)
+			break;
+	}
 	return 0;
 }
@@ -0,0 +1,252 @@
+/*
+ * Interrupt delivery latency
+ *
+ * CPU 0 stamps the TSC right before raising an interrupt and the handler
+ * on the receiving CPU stamps it on entry.  The difference is the delivery
+ * latency; both CPUs read their own TSC, so the numbers assume the TSCs
+ * are synchronized (see tsc_sync for how far off they are).
+ *
+ *   self-ipi	   ICR with the self shorthand (SELF_IPI register in x2APIC)
+ *   fixed	   fixed IPI to CPU 1, physical destination
+ *   lowest-prio   lowest-priority IPI to CPU 1, logical destination
+ *   nmi	   NMI IPI to CPU 1
+ *   ioapic	   edge on a pc-testdev IOAPIC line routed to CPU 1
+ *
+ * Every source runs in xAPIC and, if available, x2APIC mode, with CPU 1
+ * either spinning with interrupts enabled ("running") or in hlt
+ * ("halted").  Latencies are reported as min/percentiles/max in cycles.
+ */
+
+#include "libcflat.h"
+#include "processor.h"
+#include "smp.h"
+#include "apic.h"
+#include "isr.h"
+#include "atomic.h"
+#include "vm.h"
+
+#define LATENCY_VECTOR		0x43
+#define IOAPIC_LINE		0x0e
+#define TARGET			1
+#define ROUNDS			4096
+#define HALT_SETTLE		20000	/* cycles for the target to reach hlt */
+
+enum { SRC_SELF, SRC_FIXED, SRC_LOWEST, SRC_NMI, SRC_IOAPIC, NR_SOURCES };
+
+static const char *source_names[] = {
+	[SRC_SELF] = "self-ipi",
+	[SRC_FIXED] = "fixed",
+	[SRC_LOWEST] = "lowest-prio",
+	[SRC_NMI] = "nmi",
+	[SRC_IOAPIC] = "ioapic",
+};
+
+static volatile u64 recv_tsc;
+static volatile unsigned received;
+static volatile bool stop;
+static atomic_t stopped;
+static u32 logical_dest;
+static bool x2apic;		/* mode of all cpus, set by set_apic_mode() */
+static unsigned long long samples[ROUNDS];
+
+static void latency_isr(isr_regs_t *regs)
+{
+	recv_tsc = rdtsc();
+	++received;
+	apic_write(APIC_EOI, 0);
+}
+
+static void latency_nmi(isr_regs_t *regs)
+{
+	recv_tsc = rdtsc();
+	++received;
+}
+
+static void set_irq_line(unsigned line, int val)
+{
+	asm volatile("out %0, %1" : : "a"((u8)val), "d"((u16)(0x2000 + line)));
+}
+
+static void target_loop(void *halted)
+{
+	if (halted) {
+		irq_disable();
+		while (!stop)
+			asm volatile("sti; hlt; cli");
+	} else {
+		irq_enable();
+		while (!stop)
+			pause();
+		irq_disable();
+	}
+	atomic_inc(&stopped);
+}
+
+static void switch_apic_mode(void *junk)
+{
+	if (x2apic)
+		enable_x2apic();
+	else
+		reset_apic();
+}
+
+/*
+ * The mode is per cpu, so every cpu is switched.  CPU 0 goes first, so
+ * the IPIs that switch the others use its new mode.
+ */
+static void set_apic_mode(bool mode)
+{
+	int cpu;
+
+	x2apic = mode;
+	for (cpu = 0; cpu < cpu_count(); ++cpu)
+		on_cpu(cpu, switch_apic_mode, 0);
+}
+
+static void setup_logical_dest(void *junk)
+{
+	if (x2apic_enabled()) {
+		logical_dest = apic_read(APIC_LDR);
+	} else {
+		apic_write(APIC_DFR, APIC_DFR_FLAT);
+		apic_write(APIC_LDR, (1u << smp_id()) << 24);
+		logical_dest = 1u << smp_id();
+	}
+}
+
+static void send(int src)
+{
+	switch (src) {
+	case SRC_SELF:
+		if (x2apic)
+			apic_write(APIC_SELF_IPI, LATENCY_VECTOR);
+		else
+			apic_icr_write(APIC_DEST_SELF | APIC_DEST_PHYSICAL
+				       | APIC_DM_FIXED | LATENCY_VECTOR, 0);
+		break;
+	case SRC_FIXED:
+		apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL
+			       | APIC_DM_FIXED | LATENCY_VECTOR, TARGET);
+		break;
+	case SRC_LOWEST:
+		apic_icr_write(APIC_INT_ASSERT | APIC_DEST_LOGICAL
+			       | APIC_DM_LOWEST | LATENCY_VECTOR, logical_dest);
+		break;
+	case SRC_NMI:
+		apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL
+			       | APIC_DM_NMI, TARGET);
+		break;
+	case SRC_IOAPIC:
+		set_irq_line(IOAPIC_LINE, 1);
+		set_irq_line(IOAPIC_LINE, 0);
+		break;
+	}
+}
+
+static void sort_samples(void)
+{
+	unsigned long long v;
+	int i, j;
+
+	for (i = 1; i < ROUNDS; ++i) {
+		v = samples[i];
+		for (j = i; j > 0 && samples[j - 1] > v; --j)
+			samples[j] = samples[j - 1];
+		samples[j] = v;
+	}
+}
+
+static void measure(int src, bool halted)
+{
+	unsigned long long t, sum = 0;
+	int i;
+
+	received = 0;
+	if (src == SRC_SELF) {
+		irq_enable();
+	} else {
+		stop = false;
+		atomic_set(&stopped, 0);
+		on_cpu_async(TARGET, target_loop, halted ? (void *)1 : 0);
+	}
+
+	for (i = 0; i < ROUNDS; ++i) {
+		if (halted) {
+			t = rdtsc();
+			while (rdtsc() - t < HALT_SETTLE)
+				pause();
+		}
+		t = rdtsc();
+		send(src);
+		while (received == i)
+			pause();
+		samples[i] = recv_tsc - t;
+		sum += samples[i];
+	}
+
+	if (src == SRC_SELF) {
+		irq_disable();
+	} else {
+		stop = true;
+		if (halted)
+			send(SRC_FIXED);
+		while (atomic_read(&stopped) < 1)
+			pause();
+	}
+
+	sort_samples();
+	printf("%-6s %-11s %-7s min %lld p50 %lld p90 %lld p99 %lld max %lld"
+	       " avg %lld\n", x2apic ? "x2apic" : "xapic",
+	       source_names[src], halted ? "halted" : "running",
+	       samples[0], samples[ROUNDS / 2], samples[ROUNDS * 9 / 10],
+	       samples[ROUNDS * 99 / 100], samples[ROUNDS - 1], sum / ROUNDS);
+}
+
+static void run_all(void)
+{
+	int src, halted;
+
+	on_cpu(TARGET, setup_logical_dest, 0);
+	for (src = 0; src < NR_SOURCES; ++src)
+		for (halted = 0; halted < 2; ++halted) {
+			if (src == SRC_SELF && halted)
+				continue;
+			measure(src, halted);
+		}
+}
+
+int main(int ac, char **av)
+{
+	ioapic_redir_entry_t e = {
+		.vector = LATENCY_VECTOR,
+		.delivery_mode = 0,
+		.trig_mode = 0,
+		.dest_id = TARGET,
+	};
+
+	smp_init();
+	setup_vm();
+
+	if (cpu_count() < 2) {
+		printf("intr_latency needs at least 2 cpus\n");
+		return 1;
+	}
+
+	mask_pic_interrupts();
+	handle_irq(LATENCY_VECTOR, latency_isr);
+	handle_irq(2, latency_nmi);
+	ioapic_write_redir(IOAPIC_LINE, e);
+
+	if (x2apic_enabled())
+		set_apic_mode(false);
+	run_all();
+
+	if (cpuid(1).c & (1 << 21)) {
+		set_apic_mode(true);
+		run_all();
+	} else {
+		printf("x2apic (skipped, not supported)\n");
+	}
+
+	return 0;
+}
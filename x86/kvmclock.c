@@ -3,12 +3,14 @@
 #include "atomic.h"
 #include "processor.h"
 #include "kvmclock.h"
+#include "percpu.h"
 
 #define unlikely(x)	__builtin_expect(!!(x), 0)
 #define likely(x)	__builtin_expect(!!(x), 1)
 
 
-struct pvclock_vcpu_time_info __attribute__((aligned(4))) hv_clock[MAX_CPU];
+/* per cpu, so that host updates for one cpu do not hit another's line */
+static DEFINE_PER_CPU(struct pvclock_vcpu_time_info, hv_clock);
 struct pvclock_wall_clock wall_clock;
 static unsigned char valid_flags = 0;
 static atomic64_t last_value = ATOMIC64_INIT(0);
@@ -149,7 +151,9 @@ static u64 pvclock_get_nsec_offset(struct pvclock_shadow_time *shadow)
 
 /*
  * Reads a consistent set of time-base values from hypervisor,
- * into a shadow data area.
+ * into a shadow data area.  These stay real lfences rather than
+ * smp_rmb(): the rdtsc done by the caller must not be executed
+ * before the loads here.
  */
 static unsigned pvclock_get_time_values(struct pvclock_shadow_time *dst,
 					struct pvclock_vcpu_time_info *src)
@@ -214,19 +218,13 @@ cycle_t pvclock_clocksource_read(struct pvclock_vcpu_time_info *src)
 
 cycle_t kvm_clock_read()
 {
-        struct pvclock_vcpu_time_info *src;
-        cycle_t ret;
-        int index = smp_id();
-
-        src = &hv_clock[index];
-        ret = pvclock_clocksource_read(src);
-        return ret;
+        return pvclock_clocksource_read(this_cpu_ptr(&hv_clock));
 }
 
 void kvm_clock_init(void *data)
 {
         int index = smp_id();
-        struct pvclock_vcpu_time_info *hvc = &hv_clock[index];
+        struct pvclock_vcpu_time_info *hvc = this_cpu_ptr(&hv_clock);
 
         printf("kvm-clock: cpu %d, msr 0x:%lx \n", index, hvc);
         wrmsr(MSR_KVM_SYSTEM_TIME, (unsigned long)hvc | 1);
@@ -248,10 +246,10 @@ void pvclock_read_wallclock(struct pvclock_wall_clock *wall_clock,
 	/* get wallclock at system boot */
 	do {
 		version = wall_clock->version;
-		rmb();		/* fetch version before time */
+		smp_rmb();		/* fetch version before time */
 		now.tv_sec  = wall_clock->sec;
 		now.tv_nsec = wall_clock->nsec;
-		rmb();		/* fetch time before checking version */
+		smp_rmb();		/* fetch time before checking version */
 	} while ((wall_clock->version & 1) || (version != wall_clock->version));
 
 	delta = pvclock_clocksource_read(vcpu_time);	/* time since system boot */
@@ -265,15 +263,16 @@ void pvclock_read_wallclock(struct pvclock_wall_clock *wall_clock,
 
 void kvm_get_wallclock(struct timespec *ts)
 {
-        struct pvclock_vcpu_time_info *vcpu_time;
-        int index = smp_id();
-
         wrmsr(MSR_KVM_WALL_CLOCK, (unsigned long)&wall_clock);
-        vcpu_time = &hv_clock[index];
-        pvclock_read_wallclock(&wall_clock, vcpu_time, ts);
+        pvclock_read_wallclock(&wall_clock, this_cpu_ptr(&hv_clock), ts);
 }
 
 void pvclock_set_flags(unsigned char flags)
 {
         valid_flags = flags;
 }
+
+unsigned char kvm_clock_flags(void)
+{
+        return this_cpu_ptr(&hv_clock)->flags;
+}
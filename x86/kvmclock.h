@@ -52,6 +52,7 @@ struct timespec {
 };
 
 void pvclock_set_flags(unsigned char flags);
+unsigned char kvm_clock_flags(void);
 cycle_t kvm_clock_read();
 void kvm_get_wallclock(struct timespec *ts);
 void kvm_clock_init(void *data);
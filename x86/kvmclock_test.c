@@ -7,18 +7,46 @@
 #define DEFAULT_TEST_LOOPS 100000000L
 #define DEFAULT_THRESHOLD  5L
 
+/*
+ * The monotonicity check shares nothing between cpus while they read.
+ * Every read is bracketed by TSC stamps taken right before and after it,
+ * and each cpu stores its samples in its own cache-line aligned part of
+ * samples[].  Once all cpus are done with a batch the samples are merged
+ * by closing stamp: when sample Y opened after sample X closed, X's read
+ * completed before Y's started, so Y must not be earlier.  A batch only
+ * starts once the previous one is done, so the latest time seen so far
+ * is carried into the next batch.  The brackets assume the TSCs of all
+ * cpus are synchronized (tsc_sync measures how well they are).
+ */
+#define MAX_SAMPLES (1 << 18)
+#define SAMPLE_ALIGN 8            /* 8 samples fill 3 cache lines */
+
+struct sample {
+        u64 before;
+        cycle_t t;
+        u64 after;
+};
+
 struct test_info {
-        struct spinlock lock;
         long loops;               /* test loops */
         u64 warps;                /* warp count */
         u64 stalls;               /* stall count */
         long long worst;          /* worst warp */
-        volatile cycle_t last;    /* last cycle seen by test */
         atomic_t ncpus;           /* number of cpu in the test*/
         int check;                /* check cycle ? */
+        struct {
+                u64 stalls;
+                u64 ns;           /* elapsed kvmclock ns */
+        } ____cacheline_aligned cpu[MAX_CPU];
 };
 
-struct test_info ti[4];
+struct test_info ti[5];
+
+static struct sample samples[MAX_SAMPLES] __attribute__((aligned(64)));
+static u32 order[MAX_SAMPLES];
+static cycle_t prefix_max[MAX_SAMPLES + 1];
+static u32 per_cpu_samples;
+static cycle_t carry_max;
 
 static int wallclock_test(long sec, long threshold)
 {
@@ -46,69 +74,152 @@ static void kvm_clock_test(void *data)
 {
         struct test_info *hv_test_info = (struct test_info *)data;
         long i, check = hv_test_info->check;
+        int cpu = smp_id();
+        cycle_t t, prev = 0, start;
+        struct sample *s = &samples[cpu * per_cpu_samples];
+        u64 stalls = 0;
+
+        if (check == 0) {
+                start = kvm_clock_read();
+                for (i = 0; i < hv_test_info->loops; i++)
+                        kvm_clock_read();
+                hv_test_info->cpu[cpu].ns = kvm_clock_read() - start;
+                atomic_dec(&hv_test_info->ncpus);
+                return;
+        }
 
-        for (i = 0; i < hv_test_info->loops; i++){
-                cycle_t t0, t1;
-                long long delta;
+        for (i = 0; i < hv_test_info->loops; i++) {
+                s[i].before = rdtsc_ordered();
+                rmb();
+                t = kvm_clock_read();
+                s[i].after = rdtsc_ordered();
+                s[i].t = t;
 
-                if (check == 0) {
-                        kvm_clock_read();
-                        continue;
-                }
+                if (t == prev)
+                        ++stalls;
+                prev = t;
+        }
+        hv_test_info->cpu[cpu].stalls += stalls;
+
+        atomic_dec(&hv_test_info->ncpus);
+}
 
-                spin_lock(&hv_test_info->lock);
-                t1 = kvm_clock_read();
-                t0 = hv_test_info->last;
-                hv_test_info->last = kvm_clock_read();
-                spin_unlock(&hv_test_info->lock);
+/* Check the n samples each of ncpus cpus took in the last batch. */
+static void merge_samples(int ncpus, u32 n, struct test_info *hv_test_info)
+{
+        u32 pos[MAX_CPU], total = ncpus * n, k, lo, hi, mid;
+        struct sample *s, *best;
+        long long delta;
+        int cpu, from;
+
+        /* each cpu's samples are in closing order; merge them */
+        memset(pos, 0, sizeof(pos));
+        for (k = 0; k < total; k++) {
+                best = NULL;
+                from = 0;
+                for (cpu = 0; cpu < ncpus; cpu++) {
+                        if (pos[cpu] == n)
+                                continue;
+                        s = &samples[cpu * per_cpu_samples + pos[cpu]];
+                        if (!best || s->after < best->after) {
+                                best = s;
+                                from = cpu;
+                        }
+                }
+                order[k] = from * per_cpu_samples + pos[from]++;
+        }
 
-                delta = t1 - t0;
-                if (delta < 0) {
-                        spin_lock(&hv_test_info->lock);
+        /* prefix_max[k] is the latest time read by the first k to close */
+        prefix_max[0] = carry_max;
+        for (k = 0; k < total; k++) {
+                prefix_max[k + 1] = prefix_max[k];
+                if (samples[order[k]].t > prefix_max[k + 1])
+                        prefix_max[k + 1] = samples[order[k]].t;
+        }
+        carry_max = prefix_max[total];
+
+        for (cpu = 0; cpu < ncpus; cpu++) {
+                for (k = 0; k < n; k++) {
+                        s = &samples[cpu * per_cpu_samples + k];
+                        /* count the samples that closed before s opened */
+                        lo = 0;
+                        hi = total;
+                        while (lo < hi) {
+                                mid = (lo + hi) / 2;
+                                if (samples[order[mid]].after < s->before)
+                                        lo = mid + 1;
+                                else
+                                        hi = mid;
+                        }
+                        delta = s->t - prefix_max[lo];
+                        if (delta >= 0)
+                                continue;
                         ++hv_test_info->warps;
-                        if (delta < hv_test_info->worst){
+                        if (delta < hv_test_info->worst) {
                                 hv_test_info->worst = delta;
-                                printf("Worst warp %lld %\n", hv_test_info->worst);
+                                printf("Worst warp %lld on cpu %d\n",
+                                       hv_test_info->worst, cpu);
                         }
-                        spin_unlock(&hv_test_info->lock);
                 }
-                if (delta == 0)
-                        ++hv_test_info->stalls;
-
-                if (!((unsigned long)i & 31))
-                        asm volatile("rep; nop");
         }
-
-        atomic_dec(&hv_test_info->ncpus);
 }
 
-static int cycle_test(int ncpus, long loops, int check, struct test_info *ti)
+static void run_batch(int ncpus, long loops, struct test_info *ti)
 {
         int i;
-        unsigned long long begin, end;
-
-        begin = rdtsc();
 
         atomic_set(&ti->ncpus, ncpus);
         ti->loops = loops;
-        ti->check = check;
         for (i = ncpus - 1; i >= 0; i--)
                 on_cpu_async(i, kvm_clock_test, (void *)ti);
 
         /* Wait for the end of other vcpu */
         while(atomic_read(&ti->ncpus))
                 ;
+}
+
+static int cycle_test(int ncpus, long loops, int check, struct test_info *ti)
+{
+        int i;
+        long done, batch;
+        unsigned long long begin, end;
+
+        begin = rdtsc();
+
+        ti->check = check;
+        if (check == 0) {
+                run_batch(ncpus, loops, ti);
+        } else {
+                /* every cpu does loops reads, MAX_SAMPLES at a time */
+                per_cpu_samples = MAX_SAMPLES / ncpus & ~(SAMPLE_ALIGN - 1);
+                carry_max = 0;
+                for (done = 0; done < loops; done += batch) {
+                        batch = loops - done;
+                        if (batch > per_cpu_samples)
+                                batch = per_cpu_samples;
+                        run_batch(ncpus, batch, ti);
+                        merge_samples(ncpus, batch, ti);
+                }
+                ti->loops = loops;
+        }
 
         end = rdtsc();
 
         printf("Total vcpus: %d\n", ncpus);
         printf("Test  loops: %ld\n", ti->loops);
         if (check == 1) {
+                for (i = 0; i < ncpus; i++)
+                        ti->stalls += ti->cpu[i].stalls;
                 printf("Total warps:  %lld\n", ti->warps);
                 printf("Total stalls: %lld\n", ti->stalls);
                 printf("Worst warp:   %lld\n", ti->worst);
-        } else
+        } else {
                 printf("TSC cycles:  %lld\n", end - begin);
+                for (i = 0; i < ncpus; i++)
+                        printf("cpu %d: %d.%02d ns per kvm_clock_read()\n", i,
+                               (int)(ti->cpu[i].ns / loops),
+                               (int)(ti->cpu[i].ns * 100 / loops % 100));
+        }
 
         return ti->warps ? 1 : 0;
 }
@@ -151,6 +262,9 @@ int main(int ac, char **av)
         printf("Monotonic cycle test:\n");
         nerr += cycle_test(ncpus, loops, 1, &ti[1]);
 
+        printf("Host %s PVCLOCK_TSC_STABLE_BIT\n",
+               kvm_clock_flags() & PVCLOCK_TSC_STABLE_BIT ? "sets" : "clears");
+
         printf("Measure the performance of raw cycle ...\n");
         pvclock_set_flags(PVCLOCK_TSC_STABLE_BIT
                           | PVCLOCK_RAW_CYCLE_BIT);
@@ -160,6 +274,10 @@ int main(int ac, char **av)
         pvclock_set_flags(PVCLOCK_TSC_STABLE_BIT);
         cycle_test(ncpus, loops, 0, &ti[3]);
 
+        printf("Measure the performance without the stable bit ...\n");
+        pvclock_set_flags(0);
+        cycle_test(ncpus, loops, 0, &ti[4]);
+
         for (i = 0; i < ncpus; ++i)
                 on_cpu(i, kvm_clock_clear, (void *)0);
 
@@ -0,0 +1,313 @@
+/*
+ * Spinlock contention under pause-loop exiting
+ *
+ * 1, 2, 4, ... N CPUs hammer one lock for a fixed time, holding it for a
+ * configurable number of cycles.  Lock types:
+ *
+ *   xchg	xchg test-and-set without pause, the old spin_lock()
+ *   tas	xchg test-and-set, pause between attempts
+ *   ticket	spin_lock() from the library, a fair ticket lock
+ *   mcs	mcs_lock() from the library, each waiter on its own line
+ *   pvqueue	MCS queue whose waiters hlt after a while and are woken
+ *		with KVM_HC_KICK_CPU, like the Linux PV qspinlock slow path
+ *
+ * Waiters pause, so with PLE they exit to the host; the critical section
+ * is a plain spin so that the holder does not.  Overcommit comes from
+ * running more vCPUs than the host CPUs they are pinned to; compare the
+ * results against the PLE window settings of the host.
+ *
+ * Reports acquisitions per second, the spread between the least and most
+ * successful CPU, and the average and worst time spent waiting for and
+ * holding the lock, in cycles.  A lost update in the protected counter
+ * fails the test.
+ *
+ * Arguments: cs=<cycles> (may be repeated) duration=<ms>
+ */
+
+#include "libcflat.h"
+#include "processor.h"
+#include "smp.h"
+#include "atomic.h"
+#include "tsc.h"
+#include "kvm_para.h"
+
+#define MAX_CPUS		64
+#define MAX_CS			8
+#define GAP_CYCLES		200	/* outside the lock between attempts */
+#define SPIN_THRESHOLD		(1 << 15)
+
+static bool pv_unhalt;
+
+static unsigned long cs_cycles[MAX_CS] = { 0, 1000, 10000 };
+static int nr_cs = 3;
+static long duration_ms = 200;
+
+static struct cpu_stats {
+	unsigned long acquisitions;
+	unsigned long long wait, max_wait;
+	unsigned long long hold, max_hold;
+} __attribute__((aligned(64))) stats[MAX_CPUS];
+
+static unsigned long shared_counter __attribute__((aligned(64)));
+static unsigned long long end_tsc;
+static unsigned long hold_cycles;
+static atomic_t arrived, nr_done;
+
+/* No pause in here: the lock holder should not trigger PLE. */
+static void delay(unsigned long cycles)
+{
+	unsigned long long t = rdtsc();
+
+	while (rdtsc() - t < cycles)
+		barrier();
+}
+
+static volatile int tas;
+
+static void xchg_lock(int cpu)
+{
+	while (__sync_lock_test_and_set(&tas, 1))
+		;
+}
+
+static void tas_lock(int cpu)
+{
+	while (__sync_lock_test_and_set(&tas, 1))
+		pause();
+}
+
+static void tas_unlock(int cpu)
+{
+	__sync_lock_release(&tas);
+}
+
+static struct spinlock ticket __attribute__((aligned(64)));
+
+static void ticket_lock(int cpu)
+{
+	spin_lock(&ticket);
+}
+
+static void ticket_unlock(int cpu)
+{
+	spin_unlock(&ticket);
+}
+
+static struct mcs_lock mcs __attribute__((aligned(64)));
+static struct mcs_node mcs_nodes[MAX_CPUS];
+
+static void mcs_lock_cpu(int cpu)
+{
+	mcs_lock(&mcs, &mcs_nodes[cpu]);
+}
+
+static void mcs_unlock_cpu(int cpu)
+{
+	mcs_unlock(&mcs, &mcs_nodes[cpu]);
+}
+
+enum { NODE_RUNNING, NODE_HALTED, NODE_KICKED };
+
+static struct pv_node {
+	struct pv_node *volatile next;
+	volatile int locked;
+	volatile int state;
+} __attribute__((aligned(64))) nodes[MAX_CPUS];
+
+static struct pv_node *volatile pv_tail;
+
+static void pvqueue_lock(int cpu)
+{
+	struct pv_node *node = &nodes[cpu], *prev;
+	unsigned spins;
+
+	node->next = NULL;
+	node->locked = 0;
+	node->state = NODE_RUNNING;
+	prev = __sync_lock_test_and_set(&pv_tail, node);
+	if (!prev)
+		return;
+	prev->next = node;
+
+	for (;;) {
+		for (spins = 0; spins < SPIN_THRESHOLD; ++spins) {
+			if (node->locked)
+				goto out;
+			pause();
+		}
+		/* Interrupts are off; the kick alone gets us out of hlt. */
+		if (!__sync_bool_compare_and_swap(&node->state, NODE_RUNNING,
+						  NODE_HALTED))
+			continue;
+		if (!node->locked)
+			asm volatile("hlt");
+		node->state = NODE_RUNNING;
+	}
+out:
+	barrier();
+}
+
+static void pvqueue_unlock(int cpu)
+{
+	struct pv_node *node = &nodes[cpu], *next;
+
+	if (!node->next) {
+		if (__sync_bool_compare_and_swap(&pv_tail, node, NULL))
+			return;
+		while (!node->next)
+			pause();
+	}
+	next = node->next;
+	next->locked = 1;
+	if (__sync_bool_compare_and_swap(&next->state, NODE_HALTED,
+					 NODE_KICKED))
+		kvm_hypercall2(KVM_HC_KICK_CPU, 0, next - nodes);
+}
+
+static struct lock_type {
+	const char *name;
+	void (*lock)(int cpu);
+	void (*unlock)(int cpu);
+	bool *valid;
+} lock_types[] = {
+	{ "xchg", xchg_lock, tas_unlock },
+	{ "tas", tas_lock, tas_unlock },
+	{ "ticket", ticket_lock, ticket_unlock },
+	{ "mcs", mcs_lock_cpu, mcs_unlock_cpu },
+	{ "pvqueue", pvqueue_lock, pvqueue_unlock, &pv_unhalt },
+	{ NULL },
+};
+
+static struct lock_type *cur;
+static int nr_workers;
+
+static void worker(void *junk)
+{
+	int cpu = smp_id();
+	struct cpu_stats *s = &stats[cpu];
+	unsigned long long t0, t1, t2;
+
+	memset(s, 0, sizeof(*s));
+	atomic_inc(&arrived);
+	while (atomic_read(&arrived) < nr_workers)
+		pause();
+
+	while ((t0 = rdtsc()) < end_tsc) {
+		cur->lock(cpu);
+		t1 = rdtsc();
+		++shared_counter;
+		delay(hold_cycles);
+		t2 = rdtsc();
+		cur->unlock(cpu);
+
+		++s->acquisitions;
+		s->wait += t1 - t0;
+		s->hold += t2 - t1;
+		if (t1 - t0 > s->max_wait)
+			s->max_wait = t1 - t0;
+		if (t2 - t1 > s->max_hold)
+			s->max_hold = t2 - t1;
+		delay(GAP_CYCLES);
+	}
+	atomic_inc(&nr_done);
+}
+
+/* Returns false if the lock let two cpus in at once. */
+static bool run(int ncpus)
+{
+	unsigned long total = 0, lo = ~0ul, hi = 0;
+	unsigned long long wait = 0, max_wait = 0, hold = 0, max_hold = 0;
+	int cpu;
+
+	shared_counter = 0;
+	nr_workers = ncpus;
+	atomic_set(&arrived, 0);
+	atomic_set(&nr_done, 0);
+	end_tsc = rdtsc() + tsc_hz() * duration_ms / 1000;
+
+	for (cpu = ncpus - 1; cpu >= 0; --cpu)
+		on_cpu_async(cpu, worker, 0);
+	while (atomic_read(&nr_done) < ncpus)
+		pause();
+
+	for (cpu = 0; cpu < ncpus; ++cpu) {
+		struct cpu_stats *s = &stats[cpu];
+
+		total += s->acquisitions;
+		if (s->acquisitions < lo)
+			lo = s->acquisitions;
+		if (s->acquisitions > hi)
+			hi = s->acquisitions;
+		wait += s->wait;
+		hold += s->hold;
+		if (s->max_wait > max_wait)
+			max_wait = s->max_wait;
+		if (s->max_hold > max_hold)
+			max_hold = s->max_hold;
+	}
+
+	printf("%-7s cpus %2d cs %5ld: %ld acq/s, per cpu %ld..%ld,"
+	       " wait avg %lld max %lld, hold avg %lld max %lld\n",
+	       cur->name, ncpus, hold_cycles,
+	       (long)(total * 1000 / duration_ms), lo, hi,
+	       total ? wait / total : 0, max_wait,
+	       total ? hold / total : 0, max_hold);
+	if (shared_counter != total) {
+		printf("%s: %ld acquisitions but counter at %ld\n",
+		       cur->name, total, shared_counter);
+		return false;
+	}
+	return true;
+}
+
+static void parse_args(int ac, char **av)
+{
+	int i, n = 0;
+
+	for (i = 0; i < ac; ++i) {
+		if (memcmp(av[i], "cs=", 3) == 0) {
+			if (n < MAX_CS)
+				cs_cycles[n++] = atol(av[i] + 3);
+		} else if (memcmp(av[i], "duration=", 9) == 0) {
+			duration_ms = atol(av[i] + 9);
+		}
+	}
+	if (n)
+		nr_cs = n;
+	if (duration_ms < 1)
+		duration_ms = 1;
+}
+
+int main(int ac, char **av)
+{
+	int max_cpus, ncpus, c;
+	bool ok = true;
+
+	parse_args(ac - 1, av + 1);
+	smp_init();
+
+	pv_unhalt = kvm_features() & (1 << KVM_FEATURE_PV_UNHALT);
+	max_cpus = cpu_count();
+	if (max_cpus > MAX_CPUS)
+		max_cpus = MAX_CPUS;
+	printf("tsc %lld kHz, %d cpus\n", tsc_hz() / 1000, max_cpus);
+
+	for (cur = lock_types; cur->name; ++cur) {
+		if (cur->valid && !*cur->valid) {
+			printf("%s (skipped, no PV_UNHALT)\n", cur->name);
+			continue;
+		}
+		for (c = 0; c < nr_cs; ++c) {
+			hold_cycles = cs_cycles[c];
+			for (ncpus = 1; ; ncpus *= 2) {
+				if (ncpus > max_cpus)
+					ncpus = max_cpus;
+				ok &= run(ncpus);
+				if (ncpus == max_cpus)
+					break;
+			}
+		}
+	}
+
+	return ok ? 0 : 1;
+}
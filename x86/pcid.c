@@ -1,8 +1,16 @@
-/* Basic PCID & INVPCID functionality test */
+/*
+ * Basic PCID & INVPCID functionality test
+ *
+ * With "bench" on the command line, also measure the cost of switching
+ * CR3 between address spaces with and without PCID, and of each INVPCID
+ * type.  "spaces=N" and "pages=N" set the number of address spaces and
+ * the size of the working set touched after each switch.
+ */
 
 #include "libcflat.h"
 #include "processor.h"
 #include "desc.h"
+#include "vm.h"
 
 #define X86_FEATURE_PCID       (1 << 17)
 #define X86_FEATURE_INVPCID    (1 << 10)
@@ -13,6 +21,17 @@ struct invpcid_desc {
     unsigned long addr : 64;
 };
 
+#define CR3_NOFLUSH            (1ull << 63)
+
+#define BENCH_MAX_SPACES       64
+#define BENCH_MAX_PAGES        512
+#define BENCH_WS_VIRT          (1ul << 40)
+#define BENCH_SWITCHES         (1 << 14)
+
+static int nr_spaces = 16;
+static int nr_pages = 64;
+static unsigned long spaces[BENCH_MAX_SPACES];
+
 int write_cr0_checking(unsigned long val)
 {
     asm volatile(ASM_TRY("1f")
@@ -137,10 +156,167 @@ report:
     report("Test on INVPCID when disabled", passed);
 }
 
+static inline void invpcid(unsigned long type, struct invpcid_desc *desc)
+{
+    asm volatile (".byte 0x66,0x0f,0x38,0x82,0x18" /* invpcid (%rax), %rbx */
+                  : : "a" (desc), "b" (type) : "memory");
+}
+
+/*
+ * Every address space shares the kernel mappings and maps its own
+ * nr_pages private pages at BENCH_WS_VIRT.
+ */
+static void bench_create_spaces(void)
+{
+    unsigned long *kernel = phys_to_virt(read_cr3() & PTE_ADDR);
+    unsigned long *root;
+    int i, j;
+
+    for (i = 0; i < nr_spaces; ++i) {
+        root = alloc_page();
+        memcpy(root, kernel, PAGE_SIZE);
+        for (j = 0; j < nr_pages; ++j)
+            install_page(root, virt_to_phys(alloc_page()),
+                         (void *)(BENCH_WS_VIRT + j * PAGE_SIZE));
+        spaces[i] = virt_to_phys(root);
+    }
+}
+
+static u64 bench_touch(void)
+{
+    unsigned long sum = 0;
+    u64 t = rdtsc();
+    int i;
+
+    for (i = 0; i < nr_pages; ++i)
+        sum += *(volatile unsigned long *)(BENCH_WS_VIRT + i * PAGE_SIZE);
+    return rdtsc() - t;
+}
+
+static void bench_print(const char *name, u64 op, u64 refill, int n)
+{
+    printf("%-20s %8d cycles/op %8d cycles/page refill\n", name,
+           (int)(op / n), (int)(refill / n / nr_pages));
+}
+
+enum { SWITCH_NOPCID, SWITCH_PCID, SWITCH_PCID_NOFLUSH };
+
+static void bench_switch(int mode)
+{
+    static const char *names[] = {
+        [SWITCH_NOPCID] = "cr3",
+        [SWITCH_PCID] = "cr3+pcid",
+        [SWITCH_PCID_NOFLUSH] = "cr3+pcid-noflush",
+    };
+    ulong cr3 = read_cr3(), cr4 = read_cr4();
+    u64 t, op = 0, refill = 0;
+    unsigned long next;
+    int i;
+
+    if (mode != SWITCH_NOPCID)
+        write_cr4(cr4 | X86_CR4_PCIDE);
+
+    for (i = 0; i < BENCH_SWITCHES; ++i) {
+        next = spaces[i % nr_spaces];
+        if (mode != SWITCH_NOPCID)
+            next |= 1 + i % nr_spaces;
+        if (mode == SWITCH_PCID_NOFLUSH)
+            next |= CR3_NOFLUSH;
+        t = rdtsc();
+        write_cr3(next);
+        op += rdtsc() - t;
+        refill += bench_touch();
+    }
+
+    /* CR3[11:0] must be zero before PCIDE can be cleared */
+    write_cr3(cr3);
+    write_cr4(cr4);
+    bench_print(names[mode], op, refill, BENCH_SWITCHES);
+}
+
+static void bench_invpcid(unsigned long type)
+{
+    static const char *names[] = {
+        "invpcid-address", "invpcid-context",
+        "invpcid-all-global", "invpcid-all",
+    };
+    ulong cr3 = read_cr3(), cr4 = read_cr4();
+    struct invpcid_desc desc;
+    u64 t, op = 0, refill = 0;
+    int i, space;
+
+    write_cr4(cr4 | X86_CR4_PCIDE);
+    desc.rsv = 0;
+    desc.addr = BENCH_WS_VIRT;
+
+    for (i = 0; i < BENCH_SWITCHES; ++i) {
+        space = i % nr_spaces;
+        write_cr3(spaces[space] | (1 + space) | CR3_NOFLUSH);
+        bench_touch();
+        desc.pcid = 1 + space;
+        t = rdtsc();
+        invpcid(type, &desc);
+        op += rdtsc() - t;
+        refill += bench_touch();
+    }
+
+    write_cr3(cr3);
+    write_cr4(cr4);
+    bench_print(names[type], op, refill, BENCH_SWITCHES);
+}
+
+static void bench_parse_args(int ac, char **av)
+{
+    int i;
+
+    for (i = 0; i < ac; ++i) {
+        if (memcmp(av[i], "spaces=", 7) == 0)
+            nr_spaces = atol(av[i] + 7);
+        else if (memcmp(av[i], "pages=", 6) == 0)
+            nr_pages = atol(av[i] + 6);
+    }
+    if (nr_spaces < 1)
+        nr_spaces = 1;
+    if (nr_spaces > BENCH_MAX_SPACES)
+        nr_spaces = BENCH_MAX_SPACES;
+    if (nr_pages < 1)
+        nr_pages = 1;
+    if (nr_pages > BENCH_MAX_PAGES)
+        nr_pages = BENCH_MAX_PAGES;
+}
+
+static void bench(int ac, char **av, int pcid_enabled, int invpcid_enabled)
+{
+    unsigned long type;
+
+    /* the INVPCID test leaves PCIDE set */
+    write_cr4(read_cr4() & ~X86_CR4_PCIDE);
+    setup_vm();
+    bench_parse_args(ac, av);
+    bench_create_spaces();
+    printf("%d address spaces, %d pages each\n", nr_spaces, nr_pages);
+
+    bench_switch(SWITCH_NOPCID);
+    if (!pcid_enabled) {
+        printf("PCID not supported, skipping PCID benchmarks\n");
+        return;
+    }
+    bench_switch(SWITCH_PCID);
+    bench_switch(SWITCH_PCID_NOFLUSH);
+
+    if (!invpcid_enabled) {
+        printf("INVPCID not supported, skipping INVPCID benchmarks\n");
+        return;
+    }
+    for (type = 0; type < 4; ++type)
+        bench_invpcid(type);
+}
+
 int main(int ac, char **av)
 {
     struct cpuid _cpuid;
     int pcid_enabled = 0, invpcid_enabled = 0;
+    int i;
 
     setup_idt();
 
@@ -163,5 +339,11 @@ int main(int ac, char **av)
     else
         test_invpcid_disabled();
 
+    for (i = 1; i < ac; ++i)
+        if (strcmp(av[i], "bench") == 0) {
+            bench(ac - 1, av + 1, pcid_enabled, invpcid_enabled);
+            break;
+        }
+
     return report_summary();
 }
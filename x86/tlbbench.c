@@ -0,0 +1,275 @@
+/*
+ * TLB miss / page walk cost microbenchmark
+ *
+ * Maps working sets with 4K, 2M or 1G pages, touches them in strided or
+ * random order with dependent loads and reports cycles per access.  The
+ * flush tests time invlpg, a CR3 reload and (with PCID) a no-flush CR3
+ * write, plus the cost of touching the working set again afterwards.
+ *
+ * Arguments select what runs: page sizes (4k 2m 1g), patterns (strided
+ * random), ws=<KB> for a single working set size and stride=<pages>.
+ */
+
+#include "libcflat.h"
+#include "processor.h"
+#include "vm.h"
+#include "fwcfg.h"
+
+#define X86_FEATURE_PCID	(1 << 17)
+#define X86_FEATURE_GBPAGES	(1 << 26)
+#define CR3_NOFLUSH		(1ull << 63)
+
+#define GB_PAGE_SIZE		(1ul << 30)
+
+/*
+ * Working sets are read only and alias guest RAM from WS_PHYS up, which
+ * keeps clear of the legacy holes below 1M; each page size gets its own
+ * pml4 slot so the mappings never overlap.
+ */
+#define WS_PHYS			(16ul << 20)
+#define WS_WINDOW(size_idx)	((2ul + (size_idx)) << 39)
+#define WS_MIN			(64ul << 10)
+#define WS_MAX			(256ul << 20)
+#define FLUSH_WS		(4ul << 20)
+#define NR_ACCESSES		(1 << 20)
+
+struct page_size {
+	const char *name;
+	unsigned long size;
+	int level;
+	bool mapped;
+};
+
+static struct page_size sizes[] = {
+	{ "4k", PAGE_SIZE, 1 },
+	{ "2m", LARGE_PAGE_SIZE, 2 },
+	{ "1g", GB_PAGE_SIZE, 3 },
+};
+
+static const char *patterns[] = { "strided", "random" };
+
+static unsigned long phys_span;
+static unsigned long stride = 1;
+static unsigned long ws_arg;
+static bool pcid_supported;
+
+/* Always zero; keeps each load dependent on the previous one. */
+static volatile unsigned long dep_mask;
+
+static void *ws_base(int size_idx)
+{
+	return (void *)(WS_WINDOW(size_idx) + WS_PHYS);
+}
+
+static bool map_ws(int size_idx)
+{
+	struct page_size *ps = &sizes[size_idx];
+	unsigned long *cr3 = phys_to_virt(read_cr3() & PTE_ADDR);
+	unsigned long off, phys;
+
+	if (ps->mapped)
+		return true;
+
+	if (ps->level == 3) {
+		if (!(cpuid(0x80000001).d & X86_FEATURE_GBPAGES))
+			return false;
+		/* one 1G page at phys 0; ws_ok() keeps accesses inside RAM */
+		install_pte(cr3, 3, (void *)WS_WINDOW(size_idx),
+			    PTE_PRESENT | PTE_PSE, 0);
+	} else {
+		for (off = 0; off < WS_MAX; off += ps->size) {
+			phys = WS_PHYS + off % phys_span;
+			install_pte(cr3, ps->level, ws_base(size_idx) + off,
+				    phys | PTE_PRESENT
+				    | (ps->level == 2 ? PTE_PSE : 0), 0);
+		}
+	}
+	ps->mapped = true;
+	return true;
+}
+
+static bool ws_ok(int size_idx, unsigned long ws)
+{
+	if (sizes[size_idx].level != 3)
+		return true;
+	return ws <= phys_span && WS_PHYS + ws <= GB_PAGE_SIZE;
+}
+
+static inline unsigned long page_addr(void *base, unsigned long page)
+{
+	/* spread the lines over the cache sets */
+	return (unsigned long)base + (page << 12) + ((page & 63) << 6);
+}
+
+static u64 touch(void *base, unsigned long npages, bool random,
+		 unsigned long n)
+{
+	unsigned long mask = npages - 1, page = 0, dep = 0;
+	unsigned long zero = dep_mask;
+	u64 seed = 1, t;
+	unsigned long i;
+
+	t = rdtsc();
+	for (i = 0; i < n; ++i) {
+		if (random) {
+			seed = seed * 6364136223846793005ull
+				+ 1442695040888963407ull;
+			page = (seed >> 33) & mask;
+		} else {
+			page = (page + stride) & mask;
+		}
+		dep = *(volatile unsigned long *)(page_addr(base, page) + dep);
+		dep &= zero;
+	}
+	return rdtsc() - t;
+}
+
+static void bench_access(int size_idx, int pattern, unsigned long ws)
+{
+	void *base = ws_base(size_idx);
+	unsigned long npages = ws / PAGE_SIZE;
+	u64 t;
+
+	/* warm up, then measure */
+	touch(base, npages, pattern, npages);
+	t = touch(base, npages, pattern, NR_ACCESSES);
+	printf("%s %s %ldK %d\n", sizes[size_idx].name, patterns[pattern],
+	       ws >> 10, (int)(t / NR_ACCESSES));
+}
+
+enum { FLUSH_INVLPG, FLUSH_CR3, FLUSH_CR3_PCID, FLUSH_CR3_NOFLUSH };
+
+static const char *flush_names[] = {
+	[FLUSH_INVLPG] = "invlpg",
+	[FLUSH_CR3] = "cr3",
+	[FLUSH_CR3_PCID] = "cr3+pcid",
+	[FLUSH_CR3_NOFLUSH] = "cr3+pcid-noflush",
+};
+
+static void bench_flush(int size_idx, int mode, unsigned long ws)
+{
+	void *base = ws_base(size_idx);
+	unsigned long npages = ws / PAGE_SIZE;
+	unsigned long cr3 = read_cr3(), cr4 = read_cr4();
+	unsigned long i;
+	u64 t, flush = 0, refill = 0;
+	int rounds = 16, r;
+
+	if (mode >= FLUSH_CR3_PCID) {
+		if (!pcid_supported) {
+			printf("%s flush %s (skipped)\n",
+			       sizes[size_idx].name, flush_names[mode]);
+			return;
+		}
+		write_cr4(cr4 | X86_CR4_PCIDE);
+	}
+
+	for (r = 0; r < rounds; ++r) {
+		touch(base, npages, false, npages);
+
+		t = rdtsc();
+		switch (mode) {
+		case FLUSH_INVLPG:
+			for (i = 0; i < npages; ++i)
+				invlpg((void *)page_addr(base, i));
+			break;
+		case FLUSH_CR3:
+		case FLUSH_CR3_PCID:
+			write_cr3(cr3);
+			break;
+		case FLUSH_CR3_NOFLUSH:
+			write_cr3(cr3 | CR3_NOFLUSH);
+			break;
+		}
+		flush += rdtsc() - t;
+
+		refill += touch(base, npages, false, npages);
+	}
+
+	if (mode >= FLUSH_CR3_PCID)
+		write_cr4(cr4);
+
+	printf("%s flush %s %ldK flush %d refill %d\n", sizes[size_idx].name,
+	       flush_names[mode], ws >> 10, (int)(flush / rounds),
+	       (int)(refill / rounds / npages));
+}
+
+static bool wanted(const char *name, char **av, int ac, const char **group,
+		   int ngroup)
+{
+	bool any = false;
+	int i, j;
+
+	for (i = 0; i < ac; ++i)
+		for (j = 0; j < ngroup; ++j)
+			if (strcmp(av[i], group[j]) == 0) {
+				any = true;
+				if (strcmp(av[i], name) == 0)
+					return true;
+			}
+	return !any;
+}
+
+static void parse_args(int ac, char **av)
+{
+	int i;
+
+	for (i = 0; i < ac; ++i) {
+		if (memcmp(av[i], "ws=", 3) == 0)
+			ws_arg = atol(av[i] + 3) << 10;
+		else if (memcmp(av[i], "stride=", 7) == 0)
+			stride = atol(av[i] + 7);
+	}
+	if (ws_arg && (ws_arg < PAGE_SIZE || ws_arg > WS_MAX
+		       || (ws_arg & (ws_arg - 1)))) {
+		printf("ws must be a power of two between 4K and %ldK\n",
+		       WS_MAX >> 10);
+		exit(1);
+	}
+}
+
+int main(int ac, char **av)
+{
+	const char *size_names[ARRAY_SIZE(sizes)];
+	unsigned long ws;
+	int s, p, m;
+
+	setup_vm();
+	parse_args(ac - 1, av + 1);
+
+	phys_span = (fwcfg_get_u64(FW_CFG_RAM_SIZE) - WS_PHYS)
+		& ~(LARGE_PAGE_SIZE - 1);
+	pcid_supported = cpuid(1).c & X86_FEATURE_PCID;
+
+	for (s = 0; s < ARRAY_SIZE(sizes); ++s)
+		size_names[s] = sizes[s].name;
+
+	for (s = 0; s < ARRAY_SIZE(sizes); ++s) {
+		if (!wanted(sizes[s].name, av + 1, ac - 1, size_names,
+			    ARRAY_SIZE(sizes)))
+			continue;
+		if (!map_ws(s)) {
+			printf("%s (skipped, not supported)\n", sizes[s].name);
+			continue;
+		}
+
+		for (p = 0; p < ARRAY_SIZE(patterns); ++p) {
+			if (!wanted(patterns[p], av + 1, ac - 1, patterns,
+				    ARRAY_SIZE(patterns)))
+				continue;
+			for (ws = ws_arg ? ws_arg : WS_MIN;
+			     ws <= (ws_arg ? ws_arg : WS_MAX); ws *= 4) {
+				if (ws_ok(s, ws))
+					bench_access(s, p, ws);
+			}
+		}
+
+		ws = ws_arg ? ws_arg : FLUSH_WS;
+		if (!ws_ok(s, ws))
+			continue;
+		for (m = 0; m < ARRAY_SIZE(flush_names); ++m)
+			bench_flush(s, m, ws);
+	}
+
+	return 0;
+}
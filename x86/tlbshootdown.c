@@ -0,0 +1,213 @@
+/*
+ * TLB shootdown latency with native and paravirtual IPIs
+ *
+ * CPU 0 repoints a page and then has 1, 2, 4, ... other CPUs invlpg it,
+ * the way a guest kernel does after changing a mapping.  It reports
+ * cycles from the PTE write until every target has acknowledged.
+ *
+ *   native	one fixed IPI per target through the APIC ICR
+ *   pv-ipi	one KVM_HC_SEND_IPI hypercall with a bitmap of the targets
+ *   pv-flush	like pv-ipi, but targets whose steal-time area says they
+ *		are preempted get KVM_VCPU_FLUSH_TLB set instead of an IPI,
+ *		and KVM flushes them on their next entry
+ *
+ * Targets either spin touching the page ("busy") or sit in hlt ("idle").
+ */
+
+#include "libcflat.h"
+#include "processor.h"
+#include "smp.h"
+#include "apic.h"
+#include "isr.h"
+#include "atomic.h"
+#include "vm.h"
+#include "kvm_para.h"
+
+#define MSR_KVM_STEAL_TIME	0x4b564d03
+#define KVM_MSR_ENABLED		1
+#define KVM_VCPU_PREEMPTED	(1 << 0)
+#define KVM_VCPU_FLUSH_TLB	(1 << 1)
+
+#define FLUSH_VECTOR		0x42
+#define MAX_CPUS		64
+#define ROUNDS			4096
+
+struct kvm_steal_time {
+	u64 steal;
+	u32 version;
+	u32 flags;
+	u8  preempted;
+	u8  u8_pad[3];
+	u32 pad[11];
+} __attribute__((aligned(64)));
+
+static struct kvm_steal_time steal_time[MAX_CPUS];
+
+enum { MODE_NATIVE, MODE_PV_IPI, MODE_PV_FLUSH, NR_MODES };
+
+static const char *mode_names[] = {
+	[MODE_NATIVE] = "native",
+	[MODE_PV_IPI] = "pv-ipi",
+	[MODE_PV_FLUSH] = "pv-flush",
+};
+
+static u32 features;
+static int max_targets;
+
+static volatile unsigned long *flush_va;
+static unsigned long *flush_pte;
+static unsigned long flush_phys[2];
+static atomic_t acks;
+static volatile bool stop;
+static atomic_t stopped;
+
+static void flush_handler(isr_regs_t *regs)
+{
+	invlpg((void *)flush_va);
+	atomic_inc(&acks);
+	apic_write(APIC_EOI, 0);
+}
+
+static void enable_steal_time(void *junk)
+{
+	wrmsr(MSR_KVM_STEAL_TIME,
+	      virt_to_phys(&steal_time[smp_id()]) | KVM_MSR_ENABLED);
+}
+
+static void busy_target(void *junk)
+{
+	unsigned long sum = 0;
+
+	irq_enable();
+	while (!stop)
+		sum += *flush_va;
+	irq_disable();
+	atomic_inc(&stopped);
+}
+
+/* Returns the number of targets that were sent an IPI. */
+static int shootdown(int mode, int ntargets)
+{
+	unsigned long mask = 0;
+	int cpu, nsent = 0;
+	u8 state;
+
+	for (cpu = 1; cpu <= ntargets; ++cpu) {
+		if (mode == MODE_PV_FLUSH) {
+			state = steal_time[cpu].preempted;
+			if ((state & KVM_VCPU_PREEMPTED)
+			    && __sync_bool_compare_and_swap(
+				    &steal_time[cpu].preempted, state,
+				    state | KVM_VCPU_FLUSH_TLB))
+				continue;
+		}
+		if (mode == MODE_NATIVE)
+			apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL
+				       | APIC_DM_FIXED | FLUSH_VECTOR, cpu);
+		else
+			mask |= 1ul << cpu;
+		++nsent;
+	}
+	if (mask)
+		kvm_hypercall4(KVM_HC_SEND_IPI, mask, 0, 0,
+			       APIC_DM_FIXED | FLUSH_VECTOR);
+	return nsent;
+}
+
+static void measure(int mode, bool busy, int ntargets)
+{
+	unsigned long long t, total = 0;
+	int i, cpu, nsent, skipped = 0;
+
+	stop = false;
+	atomic_set(&stopped, 0);
+	if (busy)
+		for (cpu = 1; cpu <= ntargets; ++cpu)
+			on_cpu_async(cpu, busy_target, 0);
+
+	for (i = 0; i < ROUNDS; ++i) {
+		atomic_set(&acks, 0);
+		t = rdtsc();
+		*flush_pte = flush_phys[i & 1] | PTE_PRESENT | PTE_WRITE;
+		invlpg((void *)flush_va);
+		nsent = shootdown(mode, ntargets);
+		while (atomic_read(&acks) < nsent)
+			pause();
+		total += rdtsc() - t;
+		skipped += ntargets - nsent;
+	}
+
+	stop = true;
+	if (busy)
+		while (atomic_read(&stopped) < ntargets)
+			pause();
+
+	printf("%-8s %-4s targets %2d: %d cycles", mode_names[mode],
+	       busy ? "busy" : "idle", ntargets, (int)(total / ROUNDS));
+	if (mode == MODE_PV_FLUSH)
+		printf(", %d%% preempted", skipped * 100 / (ROUNDS * ntargets));
+	printf("\n");
+}
+
+static bool mode_supported(int mode)
+{
+	switch (mode) {
+	case MODE_PV_IPI:
+		return features & (1 << KVM_FEATURE_PV_SEND_IPI);
+	case MODE_PV_FLUSH:
+		return (features & (1 << KVM_FEATURE_PV_SEND_IPI))
+			&& (features & (1 << KVM_FEATURE_STEAL_TIME))
+			&& (features & (1 << KVM_FEATURE_PV_TLB_FLUSH));
+	}
+	return true;
+}
+
+int main(int ac, char **av)
+{
+	int mode, ntargets, cpu, busy;
+
+	smp_init();
+	setup_vm();
+
+	if (cpu_count() < 2) {
+		printf("tlbshootdown needs at least 2 cpus\n");
+		return 1;
+	}
+	max_targets = cpu_count() - 1;
+	if (max_targets > MAX_CPUS - 1)
+		max_targets = MAX_CPUS - 1;
+	if (max_targets > sizeof(long) * 8 - 1)
+		max_targets = sizeof(long) * 8 - 1;
+
+	features = kvm_features();
+
+	flush_phys[0] = virt_to_phys(alloc_page());
+	flush_phys[1] = virt_to_phys(alloc_page());
+	flush_va = alloc_vpage();
+	flush_pte = install_page(phys_to_virt(read_cr3()), flush_phys[0],
+				 (void *)flush_va);
+
+	if (mode_supported(MODE_PV_FLUSH))
+		for (cpu = 0; cpu <= max_targets; ++cpu)
+			on_cpu(cpu, enable_steal_time, 0);
+
+	handle_irq(FLUSH_VECTOR, flush_handler);
+
+	for (mode = 0; mode < NR_MODES; ++mode) {
+		if (!mode_supported(mode)) {
+			printf("%s (skipped, not supported)\n",
+			       mode_names[mode]);
+			continue;
+		}
+		for (busy = 0; busy < 2; ++busy)
+			for (ntargets = 1; ; ntargets *= 2) {
+				if (ntargets > max_targets)
+					ntargets = max_targets;
+				measure(mode, busy, ntargets);
+				if (ntargets == max_targets)
+					break;
+			}
+	}
+
+	return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * Cross-CPU TSC synchronization
+ *
+ * For every pair of CPUs, one side stamps its TSC and pings the other,
+ * which stamps its own TSC and pongs back.  The round trip with the
+ * smallest latency gives the best estimate of the offset between the
+ * two TSCs (remote stamp minus the midpoint of the round trip) and of
+ * the one-way latency (half the round trip).
+ *
+ * Prints the offset and latency matrices, then follows the offsets of
+ * every CPU against CPU 0 over time, and finally checks that a write to
+ * IA32_TSC_ADJUST on one CPU moves its offset by the written amount.
+ *
+ * Arguments: duration=<seconds> interval=<ms> adjust=<cycles>
+ */
+
+#include "libcflat.h"
+#include "processor.h"
+#include "smp.h"
+#include "atomic.h"
+#include "tsc.h"
+
+#define IA32_TSC_ADJUST		0x3b
+#define MAX_CPUS		64
+#define ROUNDS			1000
+
+static struct pingpong {
+	volatile unsigned long ping;
+	volatile unsigned long pong;
+	volatile u64 remote_tsc;
+	atomic_t arrived;
+	atomic_t done;
+} pp __attribute__((aligned(64)));
+
+static struct pair_result {
+	long long offset;		/* responder TSC - initiator TSC */
+	unsigned long long latency;	/* one way, cycles */
+} results[MAX_CPUS][MAX_CPUS];
+
+static int nr_cpus;
+static long duration = 10;
+static long interval_ms = 1000;
+static long long adjust = 1000000;
+static int pair_initiator, pair_responder;
+
+static void pair_barrier(void)
+{
+	atomic_inc(&pp.arrived);
+	while (atomic_read(&pp.arrived) < 2)
+		pause();
+}
+
+static void initiator(void *junk)
+{
+	struct pair_result *res = &results[pair_initiator][pair_responder];
+	unsigned long long t0, t2, best = ~0ull;
+	unsigned long r;
+
+	pair_barrier();
+	for (r = 1; r <= ROUNDS; ++r) {
+		t0 = rdtsc_ordered();
+		pp.ping = r;
+		while (pp.pong != r)
+			;
+		t2 = rdtsc_ordered();
+		if (t2 - t0 < best) {
+			best = t2 - t0;
+			res->offset = (long long)(pp.remote_tsc - t0)
+				- (long long)(best / 2);
+			res->latency = best / 2;
+		}
+	}
+	atomic_inc(&pp.done);
+}
+
+static void responder(void *junk)
+{
+	unsigned long r;
+
+	pair_barrier();
+	for (r = 1; r <= ROUNDS; ++r) {
+		while (pp.ping != r)
+			;
+		pp.remote_tsc = rdtsc_ordered();
+		barrier();
+		pp.pong = r;
+	}
+	atomic_inc(&pp.done);
+}
+
+/* CPU 0 runs its side synchronously, so it must be started last. */
+static struct pair_result *measure_pair(int a, int b)
+{
+	pp.ping = pp.pong = 0;
+	atomic_set(&pp.arrived, 0);
+	atomic_set(&pp.done, 0);
+	pair_initiator = a;
+	pair_responder = b;
+
+	if (a == 0) {
+		on_cpu_async(b, responder, 0);
+		on_cpu_async(a, initiator, 0);
+	} else {
+		on_cpu_async(a, initiator, 0);
+		on_cpu_async(b, responder, 0);
+	}
+	while (atomic_read(&pp.done) < 2)
+		pause();
+	return &results[a][b];
+}
+
+static void print_matrix(bool latency)
+{
+	int i, j;
+
+	printf("%s (row -> column, cycles)\n",
+	       latency ? "one-way latency" : "TSC offset");
+	printf("     ");
+	for (j = 0; j < nr_cpus; ++j)
+		printf(" %9d", j);
+	printf("\n");
+	for (i = 0; i < nr_cpus; ++i) {
+		printf("%4d ", i);
+		for (j = 0; j < nr_cpus; ++j) {
+			if (i == j)
+				printf(" %9s", "-");
+			else if (latency)
+				printf(" %9lld", results[i][j].latency);
+			else
+				printf(" %9lld", results[i][j].offset);
+		}
+		printf("\n");
+	}
+}
+
+static void skew_matrix(void)
+{
+	long long worst = 0, off;
+	int i, j;
+
+	for (i = 0; i < nr_cpus; ++i)
+		for (j = 0; j < nr_cpus; ++j)
+			if (i != j) {
+				off = measure_pair(i, j)->offset;
+				if (off < 0)
+					off = -off;
+				if (off > worst)
+					worst = off;
+			}
+	print_matrix(false);
+	print_matrix(true);
+	printf("worst skew %lld cycles\n", worst);
+}
+
+static void drift(void)
+{
+	unsigned long long hz = tsc_hz(), start = rdtsc(), next = start;
+	unsigned long long step = hz * interval_ms / 1000;
+	int j;
+
+	printf("offset vs cpu 0 every %ld ms for %ld s (tsc %lld kHz)\n",
+	       interval_ms, duration, hz / 1000);
+	while (rdtsc() - start < hz * duration) {
+		while (rdtsc() < next)
+			pause();
+		next += step;
+		printf("%6lld ms:", (rdtsc() - start) * 1000 / hz);
+		for (j = 1; j < nr_cpus; ++j)
+			printf(" %9lld", measure_pair(0, j)->offset);
+		printf("\n");
+	}
+}
+
+static void add_tsc_adjust(void *delta)
+{
+	wrmsr(IA32_TSC_ADJUST, rdmsr(IA32_TSC_ADJUST) + *(long long *)delta);
+}
+
+static void tsc_adjust_test(void)
+{
+	long long before, after, undo = -adjust;
+	int cpu = nr_cpus - 1;
+
+	if (!(cpuid(7).b & (1 << 1))) {
+		printf("IA32_TSC_ADJUST not supported, skipping\n");
+		return;
+	}
+
+	before = measure_pair(0, cpu)->offset;
+	on_cpu(cpu, add_tsc_adjust, &adjust);
+	after = measure_pair(0, cpu)->offset;
+	on_cpu(cpu, add_tsc_adjust, &undo);
+
+	printf("TSC_ADJUST += %lld on cpu %d: offset %lld -> %lld\n",
+	       adjust, cpu, before, after);
+	report("TSC_ADJUST moves the offset of one cpu",
+	       after - before > adjust / 2 && after - before < adjust * 3 / 2);
+
+	after = measure_pair(0, cpu)->offset;
+	printf("after restoring: offset %lld\n", after);
+}
+
+static void parse_args(int ac, char **av)
+{
+	int i;
+
+	for (i = 0; i < ac; ++i) {
+		if (memcmp(av[i], "duration=", 9) == 0)
+			duration = atol(av[i] + 9);
+		else if (memcmp(av[i], "interval=", 9) == 0)
+			interval_ms = atol(av[i] + 9);
+		else if (memcmp(av[i], "adjust=", 7) == 0)
+			adjust = atol(av[i] + 7);
+	}
+	if (interval_ms < 1)
+		interval_ms = 1;
+}
+
+int main(int ac, char **av)
+{
+	parse_args(ac - 1, av + 1);
+	smp_init();
+
+	nr_cpus = cpu_count();
+	if (nr_cpus > MAX_CPUS)
+		nr_cpus = MAX_CPUS;
+	if (nr_cpus < 2) {
+		printf("tsc_sync needs at least 2 cpus\n");
+		return 1;
+	}
+
+	skew_matrix();
+	drift();
+	tsc_adjust_test();
+
+	return report_summary();
+}
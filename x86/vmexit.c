@@ -1,3 +1,4 @@
+#include <linux/pci_regs.h>
 #include "libcflat.h"
 #include "smp.h"
 #include "processor.h"
@@ -5,6 +6,7 @@
 #include "x86/vm.h"
 #include "x86/desc.h"
 #include "x86/pci.h"
+#include "x86/tsc.h"
 
 struct test {
 	void (*func)(void);
@@ -12,6 +14,11 @@ struct test {
 	int (*valid)(void);
 	int parallel;
 	bool (*next)(struct test *);
+	/* runs and reports a whole scenario instead of timing func */
+	void (*run)(struct test *);
+	/* parameters for run: pci-testdev BAR, plain counterpart of func */
+	bool io;
+	void (*plain)(void);
 };
 
 static void outb(unsigned short port, unsigned val)
@@ -46,6 +53,7 @@ static unsigned int inl(unsigned short port)
 #define GOAL (1ull << 30)
 
 static int nr_cpus;
+static atomic_t nr_cpus_done;
 
 static void cpuid_test(void)
 {
@@ -132,22 +140,22 @@ static void mov_dr(void)
 static void ple_round_robin(void)
 {
 	struct counter {
-		volatile int n1;
+		int n1;
 		int n2;
 	} __attribute__((aligned(64)));
 	static struct counter counters[64] = { { -1, 0 } };
 	int me = smp_id();
 	int you;
-	volatile struct counter *p = &counters[me];
+	struct counter *p = &counters[me];
 
-	while (p->n1 == p->n2)
-		asm volatile ("pause");
+	while (smp_load_acquire(&p->n1) == p->n2)
+		pause();
 
 	p->n2 = p->n1;
 	you = me + 1;
 	if (you == nr_cpus)
 		you = 0;
-	++counters[you].n1;
+	smp_store_release(&counters[you].n1, counters[you].n1 + 1);
 }
 
 static void rd_tsc_adjust_msr(void)
@@ -176,6 +184,7 @@ static struct pci_test {
 	volatile void *memaddr;
 	volatile void *mem;
 	int test_idx;
+	int width;
 	uint32_t data;
 	uint32_t offset;
 } pci_test = {
@@ -270,6 +279,7 @@ static bool pci_next(struct test *test, unsigned long addr, bool io)
 			test->func = NULL;
 			return false;
 	}
+	pci_test.width = width;
 	pci_test.data = ioreadl(addr + offsetof(struct pci_test_dev_hdr, data),
 				io);
 	pci_test.offset = ioreadl(addr + offsetof(struct pci_test_dev_hdr,
@@ -306,6 +316,234 @@ static bool pci_io_next(struct test *test)
 	return ret;
 }
 
+/*
+ * pci-testdev from several CPUs at once: every CPU hammers the current
+ * testdev register until a shared deadline, one scenario at a time, for
+ * 1, 2, 4, ... CPUs.  The per-CPU counts show how fairly KVM and QEMU
+ * serve concurrent exits to the same device.
+ */
+#define PCI_SMP_MAX_CPUS	64
+#define PCI_SMP_BURST		16
+
+enum { PCI_SMP_NATIVE, PCI_SMP_MIXED, PCI_SMP_REP, PCI_SMP_NR_MODES };
+
+static const char *pci_smp_modes[] = {
+	[PCI_SMP_NATIVE] = "native",
+	[PCI_SMP_MIXED] = "mixed",
+	[PCI_SMP_REP] = "rep",
+};
+
+static struct pci_smp {
+	bool io;
+	int mode;
+	int width;
+	unsigned long long deadline;
+	struct {
+		unsigned long n;
+	} ____cacheline_aligned count[PCI_SMP_MAX_CPUS];
+	uint32_t buf[PCI_SMP_BURST];
+} pci_smp;
+
+static void pci_smp_write(int width)
+{
+	if (pci_smp.io) {
+		switch (width) {
+		case 1: outb(pci_test.ioport, pci_test.data); break;
+		case 2: outw(pci_test.ioport, pci_test.data); break;
+		default: outl(pci_test.ioport, pci_test.data); break;
+		}
+	} else {
+		switch (width) {
+		case 1: *(volatile uint8_t *)pci_test.mem = pci_test.data; break;
+		case 2: *(volatile uint16_t *)pci_test.mem = pci_test.data; break;
+		default: *(volatile uint32_t *)pci_test.mem = pci_test.data; break;
+		}
+	}
+}
+
+/*
+ * One rep outs of PCI_SMP_BURST elements for I/O.  rep movs would walk
+ * the destination across the device's other registers, so MMIO bursts
+ * are back-to-back stores to the same register instead.
+ */
+static void pci_smp_burst(void)
+{
+	void *src = pci_smp.buf;
+	unsigned long n = PCI_SMP_BURST;
+	int i;
+
+	if (!pci_smp.io) {
+		for (i = 0; i < PCI_SMP_BURST; ++i)
+			pci_smp_write(pci_smp.width);
+		return;
+	}
+	switch (pci_smp.width) {
+	case 1:
+		asm volatile("rep/outsb" : "+S"(src), "+c"(n)
+			     : "d"(pci_test.ioport) : "memory");
+		break;
+	case 2:
+		asm volatile("rep/outsw" : "+S"(src), "+c"(n)
+			     : "d"(pci_test.ioport) : "memory");
+		break;
+	default:
+		asm volatile("rep/outsl" : "+S"(src), "+c"(n)
+			     : "d"(pci_test.ioport) : "memory");
+		break;
+	}
+}
+
+static void pci_smp_worker(void *junk)
+{
+	static const int widths[] = { 1, 2, 4 };
+	unsigned long n = 0;
+	int i;
+
+	while (rdtsc() < pci_smp.deadline) {
+		for (i = 0; i < 16; ++i) {
+			switch (pci_smp.mode) {
+			case PCI_SMP_NATIVE:
+				pci_smp_write(pci_smp.width);
+				++n;
+				break;
+			case PCI_SMP_MIXED:
+				pci_smp_write(widths[(n++) % 3]);
+				break;
+			case PCI_SMP_REP:
+				pci_smp_burst();
+				n += PCI_SMP_BURST;
+				break;
+			}
+		}
+	}
+	pci_smp.count[smp_id()].n = n;
+	atomic_inc(&nr_cpus_done);
+}
+
+static void pci_smp_measure(int ncpus)
+{
+	unsigned long long t1, t2;
+	unsigned long total = 0, min = ~0ul, max = 0;
+	int i;
+
+	memset(pci_smp.count, 0, sizeof(pci_smp.count));
+	atomic_set(&nr_cpus_done, 0);
+	t1 = rdtsc();
+	pci_smp.deadline = t1 + GOAL;
+	for (i = ncpus; i > 0; i--)
+		on_cpu_async(i-1, pci_smp_worker, 0);
+	while (atomic_read_acquire(&nr_cpus_done) < ncpus)
+		pause();
+	t2 = rdtsc();
+
+	for (i = 0; i < ncpus; ++i) {
+		total += pci_smp.count[i].n;
+		if (pci_smp.count[i].n < min)
+			min = pci_smp.count[i].n;
+		if (pci_smp.count[i].n > max)
+			max = pci_smp.count[i].n;
+	}
+	printf(" %s cpus %d: %d accesses/s, per-cpu min %d max %d (%d%%)\n",
+	       pci_smp_modes[pci_smp.mode], ncpus,
+	       (int)(total * tsc_hz() / (t2 - t1)),
+	       (int)min, (int)max, max ? (int)(min * 100 / max) : 0);
+}
+
+static void pci_smp_run(struct test *test)
+{
+	int ncpus, i;
+
+	pci_smp.io = test->io;
+	pci_smp.width = pci_test.width;
+	for (i = 0; i < PCI_SMP_BURST; ++i)
+		pci_smp.buf[i] = pci_test.data;
+	printf("\n");
+
+	for (pci_smp.mode = 0; pci_smp.mode < PCI_SMP_NR_MODES; ++pci_smp.mode) {
+		for (ncpus = 1; ; ncpus *= 2) {
+			if (ncpus > nr_cpus)
+				ncpus = nr_cpus;
+			pci_smp_measure(ncpus);
+			if (ncpus == nr_cpus)
+				break;
+		}
+	}
+}
+
+/*
+ * Writes to ranges QEMU registers as coalesced (the legacy VGA window and
+ * the RTC index port) are queued in the coalesced MMIO ring and only reach
+ * QEMU on the next exit to userspace.  Each burst of writes is followed
+ * by a read from an unhandled QEMU port, which drains the ring, and the
+ * total is compared against the same pattern on a plain userspace
+ * region (the read-only HPET capabilities register, port 0x80).
+ */
+static void vga_write(void)
+{
+	*(volatile uint8_t *)0xb8000 = ' ';
+}
+
+static void hpet_write(void)
+{
+	*(volatile uint32_t *)0xfed00000 = 0;
+}
+
+static void rtc_index_write(void)
+{
+	/* register D is read-only; bit 7 clear keeps NMIs enabled */
+	outb(0x70, 0x0d);
+}
+
+static void port80_write(void)
+{
+	outb(0x80, 0);
+}
+
+static int coalesced_burst(void (*func)(void), int burst)
+{
+	unsigned long long t1, t2;
+	int n = 32, i, j;
+
+	do {
+		n *= 2;
+		t1 = rdtsc();
+		for (i = 0; i < n; ++i) {
+			for (j = 0; j < burst; ++j)
+				func();
+			inl_nop_qemu();
+		}
+		t2 = rdtsc();
+	} while ((t2 - t1) < GOAL);
+	return (t2 - t1) / n / burst;
+}
+
+static void coalesced_run(struct test *test)
+{
+	static const int bursts[] = { 1, 4, 16, 64, 256 };
+	int i;
+
+	printf("%s\n", test->name);
+	for (i = 0; i < ARRAY_SIZE(bursts); ++i)
+		printf(" burst %d: coalesced %d plain %d cycles/write\n",
+		       bursts[i], coalesced_burst(test->func, bursts[i]),
+		       coalesced_burst(test->plain, bursts[i]));
+}
+
+static void pci_config_pio(void)
+{
+	pci_config_readl_pio(0, PCI_VENDOR_ID);
+}
+
+static void pci_config_ecam(void)
+{
+	pci_config_readl_ecam(0, PCI_VENDOR_ID);
+}
+
+static int has_ecam(void)
+{
+	return pci_ecam_enabled();
+}
+
 static struct test tests[] = {
 	{ cpuid_test, "cpuid", .parallel = 1,  },
 	{ vmcall, "vmcall", .parallel = 1, },
@@ -323,12 +561,20 @@ static struct test tests[] = {
 	{ ple_round_robin, "ple-round-robin", .parallel = 1 },
 	{ wr_tsc_adjust_msr, "wr_tsc_adjust_msr", .parallel = 1 },
 	{ rd_tsc_adjust_msr, "rd_tsc_adjust_msr", .parallel = 1 },
+	{ pci_config_pio, "pci-config-pio", .parallel = 0 },
+	{ pci_config_ecam, "pci-config-ecam", has_ecam, .parallel = 0 },
 	{ NULL, "pci-mem", .parallel = 0, .next = pci_mem_next },
 	{ NULL, "pci-io", .parallel = 0, .next = pci_io_next },
+	{ vga_write, "coalesced-mmio", .run = coalesced_run,
+	  .plain = hpet_write },
+	{ rtc_index_write, "coalesced-pio", .run = coalesced_run,
+	  .plain = port80_write },
+	{ NULL, "pci-mem-smp", .next = pci_mem_next, .run = pci_smp_run },
+	{ NULL, "pci-io-smp", .next = pci_io_next, .run = pci_smp_run,
+	  .io = true },
 };
 
 unsigned iterations;
-static atomic_t nr_cpus_done;
 
 static void run_test(void *_func)
 {
@@ -364,6 +610,11 @@ static bool do_test(struct test *test)
 		return false;
 	}
 
+	if (test->run) {
+		test->run(test);
+		return test->next;
+	}
+
 	do {
 		iterations *= 2;
 		t1 = rdtsc();
@@ -375,8 +626,8 @@ static bool do_test(struct test *test)
 			atomic_set(&nr_cpus_done, 0);
 			for (i = cpu_count(); i > 0; i--)
 				on_cpu_async(i-1, run_test, func);
-			while (atomic_read(&nr_cpus_done) < cpu_count())
-				;
+			while (atomic_read_acquire(&nr_cpus_done) < cpu_count())
+				pause();
 		}
 		t2 = rdtsc();
 	} while ((t2 - t1) < GOAL);